@@ -22,26 +22,56 @@
 using boost::asio::ip::udp;
 
 asio_transmit::asio_transmit(const options &opts, boost::asio::io_service &io_service)
-    : socket(io_service)
+    : socket(io_service), sockets(opts, io_service)
 {
     socket.open(udp::v4());
     set_buffer_size(socket, opts.buffer_size);
     set_ttl(socket, opts.ttl);
+    socket.non_blocking(true);
 }
 
 void asio_transmit::send_packets(std::size_t first, std::size_t last,
                                  time_point start)
 {
     (void) start; // unused
+    if (!assigned || assigned_version != collector.version())
+    {
+        connected = sockets.assign(collector, packet_socket);
+        assigned_version = collector.version();
+        assigned = true;
+    }
     for (std::size_t i = first; i < last; i++)
     {
         packet pkt = collector.get_packet(i);
+        auto buffer = boost::asio::buffer(pkt.data, pkt.len);
+        udp::socket *s = &socket;
         udp::endpoint endpoint;
-        boost::asio::ip::address_v4::bytes_type host_raw;
-        std::memcpy(&host_raw, &pkt.dst_host, sizeof(host_raw));
-        endpoint.address(boost::asio::ip::address_v4(host_raw));
-        endpoint.port(ntohs(pkt.dst_port));
-        socket.send_to(boost::asio::buffer(pkt.data, pkt.len), endpoint);
+        if (connected)
+            s = &sockets[packet_socket[i]];
+        else
+        {
+            boost::asio::ip::address_v4::bytes_type host_raw;
+            std::memcpy(&host_raw, &pkt.dst_host, sizeof(host_raw));
+            endpoint.address(boost::asio::ip::address_v4(host_raw));
+            endpoint.port(ntohs(pkt.dst_port));
+        }
+        while (true)
+        {
+            boost::system::error_code ec;
+            if (connected)
+                s->send(buffer, 0, ec);
+            else
+                s->send_to(buffer, endpoint, 0, ec);
+            if (!ec)
+                break;
+            if (ec == boost::asio::error::would_block)
+                wait_writable(s->native_handle(), stats);
+            else if (!connected || !is_icmp_error(ec.value()))
+                throw boost::system::system_error(ec, "send failed");
+            else
+                stats.icmp_errors++;    // reported for an earlier datagram
+            stats.retries++;
+        }
     }
 }
 
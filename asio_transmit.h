@@ -18,6 +18,8 @@
 #define UDPREPLAY_ASIO_TRANSMIT_H
 
 #include <config.h>
+#include <vector>
+#include <cstdint>
 #include <boost/asio.hpp>
 #include "common.h"
 
@@ -26,6 +28,12 @@ class asio_transmit
 private:
     basic_collector collector;
     boost::asio::ip::udp::socket socket;
+    connected_sockets sockets;
+    std::vector<std::uint32_t> packet_socket;  // index into sockets, for each packet
+    std::uint64_t assigned_version = 0;
+    bool assigned = false;
+    bool connected = false;     // whether packet_socket is usable
+    transmit_stats stats;
 
 public:
     static constexpr int batch_size = 1;
@@ -36,6 +44,7 @@ public:
     collector_type &get_collector() { return collector; }
     void send_packets(std::size_t first, std::size_t last, time_point start);
     void flush() {}
+    const transmit_stats &get_stats() const { return stats; }
 };
 
 #endif // UDPREPLAY_ASIO_TRANSMIT_H
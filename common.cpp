@@ -15,17 +15,36 @@
  */
 
 #include <cstring>
+#include <algorithm>
 #include <cstddef>
 #include <iostream>
+#include <system_error>
+#include <cerrno>
+#include <atomic>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
 #include "common.h"
 
 using boost::asio::ip::udp;
 
 void basic_collector::add_packet(const packet &pkt)
 {
-    std::size_t offset = storage.size();
-    storage.insert(storage.end(), pkt.data, pkt.data + pkt.len);
-    packets.push_back(packet_info{offset, pkt.len, pkt.timestamp, pkt.dst_host, pkt.dst_port});
+    if (pkt.stable)
+        packets.push_back(packet_info{pkt.data, 0, pkt.len, pkt.timestamp, pkt.dst_host, pkt.dst_port});
+    else
+    {
+        std::size_t offset = storage.size();
+        storage.insert(storage.end(), pkt.data, pkt.data + pkt.len);
+        packets.push_back(packet_info{nullptr, offset, pkt.len, pkt.timestamp, pkt.dst_host, pkt.dst_port});
+    }
+    total_bytes += pkt.len;
+    changes++;
+}
+
+void basic_collector::keep_alive(std::shared_ptr<const void> owner)
+{
+    owners.push_back(std::move(owner));
 }
 
 std::size_t basic_collector::num_packets() const
@@ -35,8 +54,9 @@ std::size_t basic_collector::num_packets() const
 
 packet basic_collector::get_packet(std::size_t idx) const
 {
-    return {storage.data() + packets[idx].offset, packets[idx].len, packets[idx].timestamp,
-            packets[idx].dst_host, packets[idx].dst_port};
+    const packet_info &info = packets[idx];
+    const std::uint8_t *data = info.external ? info.external : storage.data() + info.offset;
+    return {data, info.len, info.timestamp, info.dst_host, info.dst_port, false};
 }
 
 std::size_t basic_collector::packet_size(std::size_t idx) const
@@ -51,9 +71,303 @@ duration basic_collector::packet_timestamp(std::size_t idx) const
 
 std::size_t basic_collector::bytes() const
 {
-    return storage.size();
+    return total_bytes;
+}
+
+void basic_collector::clear()
+{
+    storage.clear();
+    packets.clear();
+    owners.clear();
+    total_bytes = 0;
+    changes++;
+}
+
+void basic_collector::swap(basic_collector &other)
+{
+    storage.swap(other.storage);
+    packets.swap(other.packets);
+    owners.swap(other.owners);
+    std::swap(total_bytes, other.total_bytes);
+    changes++;
+    other.changes++;
+}
+
+std::uint64_t basic_collector::version() const
+{
+    return changes;
+}
+
+std::unique_ptr<basic_collector> basic_collector::clone_empty() const
+{
+    return std::unique_ptr<basic_collector>(new basic_collector());
+}
+
+void basic_collector::append(basic_collector &&other)
+{
+    // Take ownership of the other storage and refer to it by pointer
+    auto chunk = std::make_shared<std::vector<std::uint8_t>>(std::move(other.storage));
+    packets.reserve(packets.size() + other.packets.size());
+    for (const packet_info &info : other.packets)
+    {
+        packets.push_back(info);
+        if (!info.external)
+        {
+            packets.back().external = chunk->data() + info.offset;
+            packets.back().offset = 0;
+        }
+    }
+    if (!chunk->empty())
+        owners.push_back(std::move(chunk));
+    owners.insert(owners.end(), other.owners.begin(), other.owners.end());
+    total_bytes += other.total_bytes;
+    changes++;
+    other.clear();
+}
+
+
+transmit_stats &transmit_stats::operator+=(const transmit_stats &other)
+{
+    stalls += other.stalls;
+    retries += other.retries;
+    icmp_errors += other.icmp_errors;
+    blocked += other.blocked;
+    paced += other.paced;
+    max_late = std::max(max_late, other.max_late);
+    max_early = std::max(max_early, other.max_early);
+    late_packets += other.late_packets;
+    dropped_packets += other.dropped_packets;
+    dropped_bytes += other.dropped_bytes;
+    caught_up_packets += other.caught_up_packets;
+    shifted += other.shifted;
+    lateness += other.lateness;
+    gap_error += other.gap_error;
+    kernel_lateness += other.kernel_lateness;
+    kernel_gap_error += other.kernel_gap_error;
+    missing_timestamps += other.missing_timestamps;
+    zerocopy_sends += other.zerocopy_sends;
+    zerocopy_copied += other.zerocopy_copied;
+    uring_submissions += other.uring_submissions;
+    uring_sqes += other.uring_sqes;
+    uring_reaps += other.uring_reaps;
+    uring_cqes += other.uring_cqes;
+    return *this;
 }
 
+transmit_stats transmit_stats::operator-(const transmit_stats &other) const
+{
+    transmit_stats out = *this;
+    out.stalls -= other.stalls;
+    out.retries -= other.retries;
+    out.icmp_errors -= other.icmp_errors;
+    out.blocked -= other.blocked;
+    out.paced -= other.paced;
+    out.late_packets -= other.late_packets;
+    out.dropped_packets -= other.dropped_packets;
+    out.dropped_bytes -= other.dropped_bytes;
+    out.caught_up_packets -= other.caught_up_packets;
+    out.shifted -= other.shifted;
+    out.lateness = lateness - other.lateness;
+    out.gap_error = gap_error - other.gap_error;
+    out.kernel_lateness = kernel_lateness - other.kernel_lateness;
+    out.kernel_gap_error = kernel_gap_error - other.kernel_gap_error;
+    out.missing_timestamps -= other.missing_timestamps;
+    out.zerocopy_sends -= other.zerocopy_sends;
+    out.zerocopy_copied -= other.zerocopy_copied;
+    out.uring_submissions -= other.uring_submissions;
+    out.uring_sqes -= other.uring_sqes;
+    out.uring_reaps -= other.uring_reaps;
+    out.uring_cqes -= other.uring_cqes;
+    return out;
+}
+
+void transmit_stats::show(std::ostream &out) const
+{
+    if (stalls != 0 || paced != duration::zero())
+    {
+        std::chrono::duration<double> blocked_s = blocked;
+        std::chrono::duration<double> paced_s = paced;
+        out << "Blocked by the kernel for " << blocked_s.count() << "s ("
+            << stalls << " stalls, " << retries << " retries), paced for "
+            << paced_s.count() << "s\n";
+    }
+    if (icmp_errors != 0)
+        out << "ICMP errors: " << icmp_errors << " reported for earlier datagrams (the sends were retried)\n";
+    if (max_late != duration::zero() || max_early != duration::zero())
+    {
+        std::chrono::duration<double, std::micro> late = max_late;
+        std::chrono::duration<double, std::micro> early = max_early;
+        out << "Timing error: up to " << late.count() << "us late, "
+            << early.count() << "us early\n";
+    }
+    if (late_packets != 0 || dropped_packets != 0)
+    {
+        std::chrono::duration<double> shifted_s = shifted;
+        out << "Behind schedule: " << late_packets << " packets late, "
+            << dropped_packets << " dropped, " << caught_up_packets << " caught up; schedule shifted by "
+            << shifted_s.count() << "s\n";
+    }
+    if (lateness.count() != 0)
+    {
+        out << "Send lateness: ";
+        lateness.show(out);
+        out << "\nGap error:     ";
+        gap_error.show(out);
+        out << '\n';
+    }
+    if (kernel_lateness.count() != 0 || missing_timestamps != 0)
+    {
+        out << "Kernel send lateness: ";
+        kernel_lateness.show(out);
+        out << "\nKernel gap error:     ";
+        kernel_gap_error.show(out);
+        out << "\n(" << kernel_lateness.count() << " packets timestamped, "
+            << missing_timestamps << " missing)\n";
+    }
+    if (zerocopy_sends != 0)
+    {
+        out << "Zero-copy: " << zerocopy_sends - zerocopy_copied << " sends without copying, "
+            << zerocopy_copied << " copied by the kernel\n";
+    }
+    if (uring_submissions != 0 && uring_reaps != 0)
+    {
+        out << "io_uring: " << double(uring_sqes) / uring_submissions << " SQEs per submission, "
+            << double(uring_cqes) / uring_reaps << " CQEs per completion batch\n";
+    }
+}
+
+void wait_writable(int fd, transmit_stats &stats)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    pollfd pfd = {};
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while (poll(&pfd, 1, -1) < 0)
+        if (errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "poll failed");
+    stats.stalls++;
+    stats.blocked += std::chrono::high_resolution_clock::now() - start;
+}
+
+live_totals &live_totals::operator+=(const live_totals &other)
+{
+    packets += other.packets;
+    bytes += other.bytes;
+    late += other.late;
+    dropped += other.dropped;
+    icmp_errors += other.icmp_errors;
+    return *this;
+}
+
+live_totals live_totals::operator-(const live_totals &other) const
+{
+    live_totals out;
+    out.packets = packets - other.packets;
+    out.bytes = bytes - other.bytes;
+    out.late = late - other.late;
+    out.dropped = dropped - other.dropped;
+    out.icmp_errors = icmp_errors - other.icmp_errors;
+    return out;
+}
+
+live_totals live_counters::load() const
+{
+    live_totals out;
+    out.packets = packets.load(std::memory_order_relaxed);
+    out.bytes = bytes.load(std::memory_order_relaxed);
+    out.late = late.load(std::memory_order_relaxed);
+    out.dropped = dropped.load(std::memory_order_relaxed);
+    out.icmp_errors = icmp_errors.load(std::memory_order_relaxed);
+    return out;
+}
+
+static std::atomic<bool> interrupt_flag{false};
+
+static void interrupt_handler(int)
+{
+    interrupt_flag.store(true, std::memory_order_relaxed);
+}
+
+void catch_interrupts()
+{
+    struct sigaction act = {};
+    act.sa_handler = interrupt_handler;
+    // A second SIGINT kills the process as usual
+    act.sa_flags = SA_RESETHAND;
+    sigemptyset(&act.sa_mask);
+    if (sigaction(SIGINT, &act, nullptr) < 0)
+        throw std::system_error(errno, std::system_category(), "sigaction failed");
+}
+
+bool interrupted()
+{
+    return interrupt_flag.load(std::memory_order_relaxed);
+}
+
+connected_sockets::connected_sockets(const options &opts, boost::asio::io_service &io_service)
+    : io_service(io_service), limit(opts.use_destination ? opts.connect_limit : 0),
+    buffer_size(opts.buffer_size), ttl(opts.ttl)
+{
+}
+
+bool connected_sockets::assign(const basic_collector &collector, std::vector<std::uint32_t> &out)
+{
+    if (limit == 0)
+        return false;
+    std::size_t n = collector.num_packets();
+    out.resize(n);
+    std::size_t new_sockets = 0;
+    for (std::size_t pass = 0; pass < 2; pass++)
+    {
+        // The first pass just counts the new destinations
+        std::unordered_map<std::uint64_t, std::uint32_t> seen;
+        for (std::size_t i = 0; i < n; i++)
+        {
+            packet pkt = collector.get_packet(i);
+            std::uint64_t key = (std::uint64_t(pkt.dst_host) << 16) | pkt.dst_port;
+            auto pos = index.find(key);
+            if (pos != index.end())
+                out[i] = pos->second;
+            else if (pass == 0)
+            {
+                if (seen.emplace(key, 0).second && ++new_sockets + sockets.size() > limit)
+                    return false;
+            }
+            else
+            {
+                boost::asio::ip::address_v4::bytes_type host_raw;
+                std::memcpy(&host_raw, &pkt.dst_host, sizeof(host_raw));
+                udp::endpoint endpoint(boost::asio::ip::address_v4(host_raw), ntohs(pkt.dst_port));
+                std::unique_ptr<udp::socket> socket(new udp::socket(io_service, udp::v4()));
+                set_buffer_size(*socket, buffer_size);
+                set_ttl(*socket, ttl);
+                socket->non_blocking(true);
+                socket->connect(endpoint);
+                out[i] = sockets.size();
+                index.emplace(key, sockets.size());
+                sockets.push_back(std::move(socket));
+            }
+        }
+        if (new_sockets == 0)
+            break;
+    }
+    return true;
+}
+
+bool is_icmp_error(int err)
+{
+    switch (err)
+    {
+    case ECONNREFUSED:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case EHOSTDOWN:
+    case ENOPROTOOPT:
+        return true;
+    default:
+        return false;
+    }
+}
 
 void set_buffer_size(udp::socket &socket, std::size_t size)
 {
@@ -75,3 +389,25 @@ void set_ttl(udp::socket &socket, std::uint8_t ttl)
     if (ttl != 0)
         socket.set_option(boost::asio::ip::multicast::hops(ttl));
 }
+
+void set_thread_affinity(int cpu)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        throw std::system_error(errno, std::system_category(), "sched_getaffinity failed");
+    cpu %= CPU_COUNT(&allowed);
+
+    int hw_cpu = -1;
+    for (int i = 0; i <= cpu; i++)
+    {
+        hw_cpu++;
+        while (!CPU_ISSET(hw_cpu, &allowed))
+            hw_cpu++;
+    }
+
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    CPU_SET(hw_cpu, &affinity);
+    if (sched_setaffinity(0, sizeof(affinity), &affinity) < 0)
+        throw std::system_error(errno, std::system_category(), "sched_setaffinity failed");
+}
@@ -24,8 +24,14 @@
 #include <cstddef>
 #include <string>
 #include <chrono>
+#include <memory>
+#include <limits>
+#include <unordered_map>
+#include <ostream>
+#include <atomic>
 #include <boost/asio.hpp>
 #include "common.h"
+#include "histogram.h"
 
 typedef std::chrono::time_point<std::chrono::high_resolution_clock> time_point;
 typedef time_point::duration duration;
@@ -35,18 +41,54 @@ struct options
     double pps = 0;
     double mbps = 0;
     bool use_timestamps = false;
+    double speed = 1.0;
+    double max_gap = std::numeric_limits<double>::infinity();   // seconds
+    double spin_threshold = 100.0;   // microseconds
+    double pacing_quantum = 10.0;    // microseconds
+    std::string profile;             // see rate_profile
+    std::string late_policy = "burst";
+    double late_threshold = 100.0;   // microseconds
+    double catch_up_rate = 2.0;      // multiple of the nominal rate
     bool use_destination = false;
     bool pause = false;
     std::size_t buffer_size = 0;
     std::uint8_t ttl = 0;
     std::uint64_t repeat = 1;
     std::string mode = "asio";
+    std::size_t batch_size = 0;     // 0 for the mode's default
+    std::size_t connect_limit = 64;
+    bool uring_sqpoll = false;
+    bool zerocopy = false;
+    bool txtime = false;
+    std::string txtime_clock = "monotonic";
+    std::string metrics_json;       // file for JSON lines, or "-" for stdout
+    std::string metrics_listen;     // address for the Prometheus endpoint
+    bool tx_timestamps = false;
+    double stats_interval = 0;      // seconds, or 0 for no progress reports
+    bool qdisc_bypass = false;
+    unsigned int xdp_queue = 0;
+    int threads = 1;
+    bool affinity = false;
+    std::string shard = "flow";
     std::string host = "localhost";
     std::string port = "8888";
     std::string bind = "";
-    std::string input_file;
+    std::vector<std::string> input_files;
+    std::string cache_file;
     int packet_size = 0;
     int addresses = 1;
+    std::size_t reassembly_slots = 1024;
+    double reassembly_timeout = 30.0;
+    bool mmap = false;
+    bool stream = false;
+    int load_threads = 1;
+    std::size_t stream_batch = 16384;
+    std::size_t stream_depth = 4;
+    std::string filter;
+    std::uint64_t start_index = 0;
+    std::uint64_t end_index = std::numeric_limits<std::uint64_t>::max();
+    double start_time = 0.0;
+    double end_time = std::numeric_limits<double>::infinity();
 };
 
 struct packet
@@ -56,6 +98,11 @@ struct packet
     duration timestamp;  // relative to start of capture
     std::uint32_t dst_host;    // in big endian
     std::uint16_t dst_port;    // in big endian
+    /* If true, data remains valid for as long as the collector holds a
+     * reference to it (see basic_collector::keep_alive), so the collector
+     * may refer to it instead of taking a copy.
+     */
+    bool stable;
 };
 
 class basic_collector
@@ -63,6 +110,7 @@ class basic_collector
 private:
     struct packet_info
     {
+        const std::uint8_t *external;   // nullptr if the payload is in storage
         std::size_t offset;
         std::size_t len;
         duration timestamp;
@@ -72,17 +120,169 @@ private:
 
     std::vector<std::uint8_t> storage;
     std::vector<packet_info> packets;
+    std::vector<std::shared_ptr<const void>> owners;
+    std::size_t total_bytes = 0;
+    std::uint64_t changes = 0;
 
 public:
     void add_packet(const packet &pkt);
+    /// Hold a reference to memory backing stable packets
+    void keep_alive(std::shared_ptr<const void> owner);
     std::size_t num_packets() const;
     packet get_packet(std::size_t idx) const;
     std::size_t packet_size(std::size_t idx) const;
     duration packet_timestamp(std::size_t idx) const;
     std::size_t bytes() const;   // total payload bytes collected
+    void clear();                // remove all packets, but keep the memory
+    void swap(basic_collector &other);
+    /// A value that changes whenever the packets (or their locations) change
+    std::uint64_t version() const;
+    /// Create an empty collector that could be appended to this one
+    std::unique_ptr<basic_collector> clone_empty() const;
+    /// Move all the packets from @a other to the end of this collector, without copying payloads
+    void append(basic_collector &&other);
 };
 
+/* Where a transmitter spent its time waiting, to show whether the kernel
+ * (a full socket buffer or ring) or the requested rate was the limit.
+ */
+struct transmit_stats
+{
+    std::uint64_t stalls = 0;     // sends that found no room and had to wait
+    std::uint64_t retries = 0;    // extra system calls to complete stalled or partial sends
+    std::uint64_t icmp_errors = 0;  // ICMP errors for earlier datagrams, reported by (and retried) sends
+    duration blocked{};           // time spent waiting for room
+    duration paced{};             // time spent sleeping to hold the rate
+    /* Largest differences between when packets were sent and their send
+     * times. These are over the whole run, even when subtracting.
+     */
+    duration max_late{};
+    duration max_early{};
+    // Effects of --late-policy
+    std::uint64_t late_packets = 0;     // sent (or rescheduled) after the late threshold
+    std::uint64_t dropped_packets = 0;
+    std::uint64_t dropped_bytes = 0;
+    std::uint64_t caught_up_packets = 0;  // sent faster than nominal to catch up
+    duration shifted{};                 // total delay added to the schedule
+    /* How late each packet was relative to its send time, and the error in
+     * its gap from the previous packet, measured when the send call was
+     * made and (with --tx-timestamps) when the kernel sent it.
+     */
+    histogram lateness;
+    histogram gap_error;
+    histogram kernel_lateness;
+    histogram kernel_gap_error;
+    std::uint64_t missing_timestamps = 0;   // packets the kernel did not timestamp
+    // MSG_ZEROCOPY sends (with --zerocopy) whose completions have been read
+    std::uint64_t zerocopy_sends = 0;
+    std::uint64_t zerocopy_copied = 0;      // of which the kernel copied anyway
+    // io_uring system calls and batches (with --mode=uring)
+    std::uint64_t uring_submissions = 0;
+    std::uint64_t uring_sqes = 0;
+    std::uint64_t uring_reaps = 0;          // batches of completions read
+    std::uint64_t uring_cqes = 0;
+
+    transmit_stats &operator+=(const transmit_stats &other);
+    transmit_stats operator-(const transmit_stats &other) const;
+    void show(std::ostream &out) const;
+};
+
+/// Wait for the non-blocking socket @a fd to become writable, recording a stall
+void wait_writable(int fd, transmit_stats &stats);
+
+/// Running totals of what has been sent
+struct live_totals
+{
+    std::uint64_t packets = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t late = 0;       // beyond the late threshold (see --late-policy)
+    std::uint64_t dropped = 0;    // by --late-policy=drop
+    std::uint64_t icmp_errors = 0;  // see transmit_stats::icmp_errors
+
+    live_totals &operator+=(const live_totals &other);
+    live_totals operator-(const live_totals &other) const;
+};
+
+/* Running totals kept by a sending thread, which other threads may read
+ * while it runs. Only the owning thread writes, so an update is a relaxed
+ * load and store rather than a locked read-modify-write, and the counters
+ * are padded so that no other data shares their cache line.
+ */
+class live_counters
+{
+private:
+    char pad_before[64];
+    std::atomic<std::uint64_t> packets{0};
+    std::atomic<std::uint64_t> bytes{0};
+    std::atomic<std::uint64_t> late{0};
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<std::uint64_t> icmp_errors{0};
+    char pad_after[64];
+
+    static void add(std::atomic<std::uint64_t> &counter, std::uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    void add_sent(std::uint64_t n_packets, std::uint64_t n_bytes)
+    {
+        add(packets, n_packets);
+        add(bytes, n_bytes);
+    }
+    void add_late(std::uint64_t n) { add(late, n); }
+    void add_dropped(std::uint64_t n) { add(dropped, n); }
+    void set_icmp_errors(std::uint64_t n) { icmp_errors.store(n, std::memory_order_relaxed); }
+    live_totals load() const;
+};
+
+/// Ask the sending loops to stop when SIGINT is received
+void catch_interrupts();
+/// Whether SIGINT has been received
+bool interrupted();
+
+/* Connected sockets for the destinations of a collector's packets, which
+ * spare the kernel a route and neighbour lookup for every datagram. They
+ * are only used with --use-destination, since a connected socket reports
+ * ICMP errors for earlier datagrams (such as port unreachable) on later
+ * sends. Sockets are kept when the collector is refilled (as when
+ * streaming), up to --connect-limit destinations in total. The sockets are
+ * non-blocking.
+ */
+class connected_sockets
+{
+private:
+    boost::asio::io_service &io_service;
+    std::size_t limit;
+    std::size_t buffer_size;
+    std::uint8_t ttl;
+    std::vector<std::unique_ptr<boost::asio::ip::udp::socket>> sockets;
+    std::unordered_map<std::uint64_t, std::uint32_t> index;
+
+public:
+    connected_sockets(const options &opts, boost::asio::io_service &io_service);
+
+    /**
+     * Find (opening if necessary) the socket for each packet in @a
+     * collector, and store its index in @a out. If that would exceed the
+     * limit, or connected sockets are not in use, return false (leaving @a
+     * out unspecified) so that the caller can use unconnected sends instead.
+     */
+    bool assign(const basic_collector &collector, std::vector<std::uint32_t> &out);
+    std::size_t size() const { return sockets.size(); }
+    boost::asio::ip::udp::socket &operator[](std::size_t idx) { return *sockets[idx]; }
+};
+
+/**
+ * Whether a send on a connected socket failed only because it reported an
+ * ICMP error from an earlier datagram (such as port unreachable). The
+ * datagram was not sent, but the send can simply be retried.
+ */
+bool is_icmp_error(int err);
+
 void set_buffer_size(boost::asio::ip::udp::socket &socket, std::size_t size);
 void set_ttl(boost::asio::ip::udp::socket &socket, std::uint8_t ttl);
+/// Pin the calling thread to the @a cpu'th CPU that it is allowed to use (modulo the number of them)
+void set_thread_affinity(int cpu);
 
 #endif // UDPREPLAY_COMMON_H
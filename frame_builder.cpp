@@ -0,0 +1,302 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+#include <stdexcept>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <netpacket/packet.h>
+#include "frame_builder.h"
+
+interface_info get_interface(const boost::asio::ip::address &address)
+{
+    ifaddrs *ifap;
+    if (getifaddrs(&ifap) < 0)
+        throw std::system_error(errno, std::system_category(), "getifaddrs failed");
+    std::unique_ptr<ifaddrs, freeifaddrs_deleter> ifap_owner(ifap);
+
+    // Map address to an interface name
+    char *if_name = nullptr;
+    unsigned int if_flags = 0;
+    for (ifaddrs *cur = ifap; cur; cur = cur->ifa_next)
+    {
+        if (cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_INET && address.is_v4())
+        {
+            const sockaddr_in *cur_address = (const sockaddr_in *) cur->ifa_addr;
+            const auto expected = address.to_v4().to_bytes();
+            if (memcmp(&cur_address->sin_addr, &expected, sizeof(expected)) == 0)
+            {
+                if_name = cur->ifa_name;
+                if_flags = cur->ifa_flags;
+                break;
+            }
+        }
+        else if (cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_INET6 && address.is_v6())
+        {
+            const sockaddr_in6 *cur_address = (const sockaddr_in6 *) cur->ifa_addr;
+            const auto expected = address.to_v6().to_bytes();
+            if (memcmp(&cur_address->sin6_addr, &expected, sizeof(expected)) == 0)
+            {
+                if_name = cur->ifa_name;
+                if_flags = cur->ifa_flags;
+                break;
+            }
+        }
+    }
+    if (!if_name)
+    {
+        throw std::runtime_error("no interface found with the address " + address.to_string());
+    }
+
+    interface_info info;
+    info.name = if_name;
+    info.flags = if_flags;
+    info.index = if_nametoindex(if_name);
+    if (info.index == 0)
+        throw std::system_error(errno, std::system_category(), "if_nametoindex failed");
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "socket failed");
+    ifreq ifr = {};
+    std::strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+    int status = ioctl(fd, SIOCGIFMTU, &ifr);
+    int err = errno;
+    close(fd);
+    if (status < 0)
+        throw std::system_error(err, std::system_category(), "SIOCGIFMTU failed");
+    info.mtu = ifr.ifr_mtu;
+
+    // Now find the MAC address for this interface
+    for (ifaddrs *cur = ifap; cur; cur = cur->ifa_next)
+    {
+        if (strcmp(cur->ifa_name, if_name) == 0
+            && cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_PACKET)
+        {
+            const sockaddr_ll *ll = (sockaddr_ll *) cur->ifa_addr;
+            if ((ll->sll_hatype == ARPHRD_ETHER || ll->sll_hatype == ARPHRD_LOOPBACK)
+                && ll->sll_halen == 6)
+            {
+                std::memcpy(&info.mac, ll->sll_addr, 6);
+                return info;
+            }
+        }
+    }
+    throw std::runtime_error(std::string("no MAC address found for interface ") + if_name);
+}
+
+mac_address multicast_mac(const boost::asio::ip::address_v4 &address)
+{
+    mac_address ans;
+    auto bytes = address.to_bytes();
+    std::memcpy(&ans[2], &bytes, 4);
+    ans[0] = 0x01;
+    ans[1] = 0x00;
+    ans[2] = 0x5e;
+    ans[3] &= 0x7f;
+    return ans;
+}
+
+
+/* Finds the next hop for @a dst_host (big endian) in the routing table, or
+ * returns false if there is no route through @a iface.
+ */
+static bool next_hop(const std::string &iface, std::uint32_t dst_host, std::uint32_t &out)
+{
+    std::ifstream in("/proc/net/route");
+    std::string line;
+    std::getline(in, line);   // column headings
+    int best_prefix = -1;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string name;
+        std::uint32_t dest, gateway, mask;
+        unsigned int flags, refcnt, use, metric;
+        // Addresses are printed as the raw (big endian) values in hex
+        fields >> name >> std::hex >> dest >> gateway >> flags
+            >> std::dec >> refcnt >> use >> metric >> std::hex >> mask;
+        if (!fields || name != iface || !(flags & RTF_UP) || (dst_host & mask) != dest)
+            continue;
+        int prefix = __builtin_popcount(mask);
+        if (prefix > best_prefix)
+        {
+            best_prefix = prefix;
+            out = (flags & RTF_GATEWAY) ? gateway : dst_host;
+        }
+    }
+    return best_prefix >= 0;
+}
+
+/// Finds a complete entry for @a host (big endian) in the ARP table
+static bool lookup_neighbour(const std::string &iface, std::uint32_t host, mac_address &out)
+{
+    char host_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &host, host_str, sizeof(host_str));
+    std::ifstream in("/proc/net/arp");
+    std::string line;
+    std::getline(in, line);   // column headings
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string ip, hw_type, flags, hw_address, mask, device;
+        fields >> ip >> hw_type >> flags >> hw_address >> mask >> device;
+        if (!fields || ip != host_str || device != iface)
+            continue;
+        if (!(std::stoul(flags, nullptr, 16) & ATF_COM))
+            continue;
+        unsigned int bytes[6];
+        if (std::sscanf(hw_address.c_str(), "%x:%x:%x:%x:%x:%x",
+                        &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6)
+            continue;
+        for (int i = 0; i < 6; i++)
+            out[i] = bytes[i];
+        return true;
+    }
+    return false;
+}
+
+mac_resolver::mac_resolver(const interface_info &iface) : iface(iface)
+{
+}
+
+mac_address mac_resolver::resolve(std::uint32_t dst_host)
+{
+    boost::asio::ip::address_v4::bytes_type dst_raw;
+    std::memcpy(&dst_raw, &dst_host, sizeof(dst_raw));
+    boost::asio::ip::address_v4 dst(dst_raw);
+    if (dst.is_multicast())
+        return multicast_mac(dst);
+    if (dst == boost::asio::ip::address_v4::broadcast())
+        return mac_address{{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
+    // The kernel uses the interface's own address when there is no ARP
+    if (iface.flags & (IFF_NOARP | IFF_LOOPBACK))
+        return iface.mac;
+
+    std::uint32_t hop;
+    if (!next_hop(iface.name, dst_host, hop))
+        throw std::runtime_error("no route to " + dst.to_string() + " through " + iface.name);
+    mac_address mac;
+    if (lookup_neighbour(iface.name, hop, mac))
+        return mac;
+
+    // Send a datagram there, so that the kernel resolves the address
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "socket failed");
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = dst_host;
+    addr.sin_port = htons(9);   // discard
+    sendto(fd, nullptr, 0, 0, (const sockaddr *) &addr, sizeof(addr));
+    close(fd);
+    for (int i = 0; i < 30; i++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (lookup_neighbour(iface.name, hop, mac))
+            return mac;
+    }
+    throw std::runtime_error("could not resolve the MAC address for " + dst.to_string());
+}
+
+mac_address mac_resolver::operator()(std::uint32_t dst_host)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto pos = cache.find(dst_host);
+    if (pos == cache.end())
+        pos = cache.emplace(dst_host, resolve(dst_host)).first;
+    return pos->second;
+}
+
+
+static std::uint16_t ip_checksum(const std::uint8_t *header)
+{
+    std::uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2)
+    {
+        if (i == 10)
+            continue;   // skip the checksum itself
+        std::uint16_t word;
+        std::memcpy(&word, header + i, sizeof(word));
+        sum += ntohs(word);
+    }
+    while (sum > 0xffff)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~htons(sum);
+}
+
+frame_builder::frame_builder(
+    const boost::asio::ip::udp::endpoint &src_endpoint,
+    const mac_address &src_mac, std::uint8_t ttl)
+    : src_endpoint(src_endpoint), src_mac(src_mac), ttl(ttl)
+{
+}
+
+void frame_builder::build(std::uint8_t *data, const packet &pkt, const mac_address &dst_mac) const
+{
+    boost::asio::ip::address_v4::bytes_type dst_addr;
+    std::memcpy(&dst_addr, &pkt.dst_host, sizeof(dst_addr));
+
+    memset(data, 0, header_size); // Headers
+    // Ethernet header
+    std::uint8_t *ether = data;
+    std::memcpy(ether + 0, &dst_mac, sizeof(dst_mac));
+    std::memcpy(ether + 6, &src_mac, sizeof(src_mac));
+    ether[12] = 0x08; // ETHERTYPE_IP
+    ether[13] = 0x00;
+
+    // IP header
+    std::uint8_t *ip = ether + 14;
+    ip[0] = 0x45;  // Version 4, header length 20
+    if (ttl != 0)
+        ip[8] = ttl;
+    else
+        ip[8] = boost::asio::ip::address_v4(dst_addr).is_multicast() ? 1 : 64;
+    ip[9] = 0x11;  // Protocol: UDP
+    auto src_addr = src_endpoint.address().to_v4().to_bytes();
+    std::uint16_t length_ip = htons(pkt.len + 28);
+    std::memcpy(ip + 2, &length_ip, sizeof(length_ip));
+    std::memcpy(ip + 12, &src_addr, sizeof(src_addr));
+    std::memcpy(ip + 16, &dst_addr, sizeof(dst_addr));
+    std::uint16_t checksum = ip_checksum(ip);
+    std::memcpy(ip + 10, &checksum, sizeof(checksum));
+
+    // UDP header
+    std::uint8_t *udp = ip + 20;
+    std::uint16_t src_port_be = htons(src_endpoint.port());
+    std::uint16_t dst_port_be = pkt.dst_port;
+    std::uint16_t length_udp = htons(pkt.len + 8);
+    std::memcpy(udp + 0, &src_port_be, sizeof(src_port_be));
+    std::memcpy(udp + 2, &dst_port_be, sizeof(dst_port_be));
+    std::memcpy(udp + 4, &length_udp, sizeof(length_udp));
+
+    // Payload
+    std::memcpy(udp + 8, pkt.data, pkt.len);
+}
+
+constexpr std::size_t frame_builder::header_size;
@@ -0,0 +1,99 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_FRAME_BUILDER_H
+#define UDPREPLAY_FRAME_BUILDER_H
+
+#include <config.h>
+#include <array>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <boost/asio.hpp>
+#include <ifaddrs.h>
+#include "common.h"
+
+/* Support for transmit modes that bypass the kernel's UDP stack, and hence
+ * have to build the Ethernet, IP and UDP headers themselves.
+ */
+
+typedef std::array<std::uint8_t, 6> mac_address;
+
+struct freeifaddrs_deleter
+{
+    void operator()(ifaddrs *ifa) const { freeifaddrs(ifa); }
+};
+
+/// Properties of a network interface
+struct interface_info
+{
+    std::string name;
+    unsigned int index;
+    unsigned int flags;       // IFF_* flags
+    int mtu;
+    mac_address mac;
+};
+
+/// Finds the interface that has a given IP address
+interface_info get_interface(const boost::asio::ip::address &address);
+
+/// Ethernet address to which an IPv4 multicast group is mapped
+mac_address multicast_mac(const boost::asio::ip::address_v4 &address);
+
+/* Finds the destination MAC address for IPv4 packets sent from an interface.
+ * Multicast and broadcast addresses are mapped directly. Unicast addresses
+ * are looked up in the kernel's neighbour table (for the gateway, if the
+ * address is not on a local subnet); if there is no entry, the kernel is
+ * prompted to resolve it. Results are cached, and it may be used by several
+ * threads at once.
+ */
+class mac_resolver
+{
+private:
+    interface_info iface;
+    std::mutex mutex;
+    std::unordered_map<std::uint32_t, mac_address> cache;
+
+    mac_address resolve(std::uint32_t dst_host);
+
+public:
+    explicit mac_resolver(const interface_info &iface);
+
+    /// Look up an IPv4 address given in big endian
+    mac_address operator()(std::uint32_t dst_host);
+};
+
+/// Writes the Ethernet, IPv4 and UDP headers for packets from a fixed source
+class frame_builder
+{
+private:
+    boost::asio::ip::udp::endpoint src_endpoint;
+    mac_address src_mac;
+    std::uint8_t ttl;
+
+public:
+    static constexpr std::size_t header_size = 42;
+
+    frame_builder(const boost::asio::ip::udp::endpoint &src_endpoint,
+                  const mac_address &src_mac, std::uint8_t ttl);
+
+    /// Write the frame for @a pkt (header_size + pkt.len bytes) to @a data
+    void build(std::uint8_t *data, const packet &pkt, const mac_address &dst_mac) const;
+};
+
+#endif // UDPREPLAY_FRAME_BUILDER_H
@@ -0,0 +1,211 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_SENDMMSG && HAVE_DECL_UDP_SEGMENT
+
+#include <system_error>
+#include <stdexcept>
+#include <cstring>
+#include <cassert>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <boost/asio.hpp>
+#include "gso_transmit.h"
+
+using boost::asio::ip::udp;
+
+gso_transmit::gso_transmit(const options &opts, boost::asio::io_service &io_service)
+    : socket(io_service)
+{
+    socket.open(udp::v4());
+    set_buffer_size(socket, opts.buffer_size);
+    set_ttl(socket, opts.ttl);
+    socket.non_blocking(true);
+    fd = socket.native_handle();
+    if (opts.zerocopy)
+    {
+        zerocopy.reset(new zerocopy_tracker(fd, stats));
+        max_iovecs = max_zerocopy_iovecs;
+    }
+}
+
+gso_transmit::~gso_transmit()
+{
+    if (zerocopy)
+    {
+        try
+        {
+            flush();
+        }
+        catch (std::exception &e)
+        {
+            // Only happens if sending has already failed
+        }
+    }
+}
+
+static bool adjacent(const iovec &iov, const packet &pkt)
+{
+    return (const u_char *) iov.iov_base + iov.iov_len == pkt.data;
+}
+
+void gso_transmit::send_packets(std::size_t first, std::size_t last,
+                                time_point start)
+{
+    struct message_info
+    {
+        std::size_t first;        // index of first packet
+        std::size_t bytes;        // total payload
+        std::uint16_t segment;    // segment size, or 0 if not segmented
+    };
+    union control_buffer
+    {
+        char buf[CMSG_SPACE(sizeof(std::uint16_t))];
+        cmsghdr align;
+    };
+
+    mmsghdr msg_vec[batch_size];
+    iovec msg_iov[batch_size];
+    sockaddr_in addr[batch_size];
+    control_buffer control[batch_size];
+    message_info info[batch_size];
+
+    assert(last - first <= batch_size);
+    std::memset(&msg_vec, 0, sizeof(msg_vec));
+    int next = 0;
+    std::size_t next_iov = 0;
+    std::size_t i = first;
+    while (i != last)
+    {
+        packet pkt = collector.get_packet(i);
+        msghdr &hdr = msg_vec[next].msg_hdr;
+        addr[next].sin_family = AF_INET;
+        addr[next].sin_addr.s_addr = pkt.dst_host;
+        addr[next].sin_port = pkt.dst_port;
+        std::memset(&addr[next].sin_zero, 0, sizeof(addr[next].sin_zero));
+        hdr.msg_name = (void *) &addr[next];
+        hdr.msg_namelen = sizeof(addr[next]);
+        hdr.msg_iov = &msg_iov[next_iov];
+        info[next].first = i;
+        info[next].bytes = 0;
+
+        // Extend the run while the packets match
+        std::size_t run = 0;
+        std::size_t iovs = 0;
+        while (true)
+        {
+            // Payloads that are adjacent in memory share an iovec
+            if (iovs > 0 && adjacent(msg_iov[next_iov - 1], pkt))
+                msg_iov[next_iov - 1].iov_len += pkt.len;
+            else
+            {
+                msg_iov[next_iov].iov_base = const_cast<u_char *>(pkt.data);
+                msg_iov[next_iov].iov_len = pkt.len;
+                next_iov++;
+                iovs++;
+            }
+            info[next].bytes += pkt.len;
+            run++;
+            i++;
+            if (i == last || run == max_segments
+                || pkt.len == 0 || pkt.len > max_segment_size
+                || info[next].bytes + pkt.len > max_message_size)
+                break;
+            packet cand = collector.get_packet(i);
+            if (cand.len != pkt.len || cand.dst_host != pkt.dst_host || cand.dst_port != pkt.dst_port)
+                break;
+            if (iovs == max_iovecs && !adjacent(msg_iov[next_iov - 1], cand))
+                break;
+            pkt = cand;
+        }
+        hdr.msg_iovlen = iovs;
+
+        if (run > 1)
+        {
+            info[next].segment = pkt.len;
+            hdr.msg_control = control[next].buf;
+            hdr.msg_controllen = sizeof(control[next].buf);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint16_t));
+            std::memcpy(CMSG_DATA(cmsg), &info[next].segment, sizeof(std::uint16_t));
+        }
+        else
+            info[next].segment = 0;
+        next++;
+    }
+
+    const int flags = zerocopy ? zerocopy_tracker::send_flags : 0;
+    int done = 0;
+    while (done < next)
+    {
+        int status = sendmmsg(fd, &msg_vec[done], next - done, flags);
+        if (status < 0)
+        {
+            int err = errno;
+            if (info[done].segment != 0 && (err == EMSGSIZE || err == EINVAL || err == EIO))
+            {
+                /* EMSGSIZE or EINVAL indicates that the segment is too big
+                 * for the route, and EIO that the device cannot do checksum
+                 * offload. Stop combining such packets and send the rest
+                 * again.
+                 */
+                if (err != EIO)
+                    max_segment_size = info[done].segment - 1;
+                else
+                    max_segment_size = 0;
+                send_packets(info[done].first, last, start);
+                return;
+            }
+            if (err == EAGAIN || err == EWOULDBLOCK)
+                wait_writable(fd, stats);
+            else if (zerocopy)
+                zerocopy->handle_error(err);
+            else
+                throw std::system_error(err, std::system_category(), "sendmmsg failed");
+            stats.retries++;
+            continue;
+        }
+        for (int j = done; j < done + status; j++)
+            if (msg_vec[j].msg_len != info[j].bytes)
+                throw std::runtime_error("short write");
+        if (zerocopy)
+            zerocopy->add_sent(status);
+        done += status;
+        if (done < next)
+            stats.retries++;    // the socket buffer filled part-way
+    }
+    if (zerocopy)
+        zerocopy->reap();
+}
+
+void gso_transmit::flush()
+{
+    // Payloads may only be reused once the kernel has finished with them
+    if (zerocopy)
+        zerocopy->wait(0);
+}
+
+constexpr int gso_transmit::batch_size;
+constexpr std::size_t gso_transmit::max_segments;
+constexpr std::size_t gso_transmit::max_message_size;
+constexpr std::size_t gso_transmit::max_zerocopy_iovecs;
+
+#endif // HAVE_SENDMMSG && HAVE_DECL_UDP_SEGMENT
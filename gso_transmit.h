@@ -0,0 +1,74 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_GSO_TRANSMIT_H
+#define UDPREPLAY_GSO_TRANSMIT_H
+
+#include <config.h>
+
+#if HAVE_SENDMMSG && HAVE_DECL_UDP_SEGMENT
+
+#include <limits>
+#include <memory>
+#include <cstddef>
+#include <boost/asio.hpp>
+#include "common.h"
+#include "zerocopy.h"
+
+/* Like sendmmsg_transmit, but consecutive packets with the same size and
+ * destination are combined into a single message, which the kernel splits
+ * into datagrams (UDP generic segmentation offload).
+ */
+class gso_transmit
+{
+public:
+    static constexpr int batch_size = 128;
+    /// Segments per message accepted by all kernels (UDP_MAX_SEGMENTS)
+    static constexpr std::size_t max_segments = 64;
+    /// Largest total payload of a message
+    static constexpr std::size_t max_message_size = 65507;
+    /* With zero-copy, each iovec of a message becomes at least one page
+     * fragment of the socket buffer, and there is a limit on the number of
+     * fragments (MAX_SKB_FRAGS), so fewer iovecs can be used.
+     */
+    static constexpr std::size_t max_zerocopy_iovecs = 8;
+
+private:
+    basic_collector collector;
+    boost::asio::ip::udp::socket socket;
+    int fd;
+    /* Largest packet to combine. It is reduced if the kernel rejects a
+     * segment size (e.g., because it exceeds the MTU).
+     */
+    std::size_t max_segment_size = std::numeric_limits<std::size_t>::max();
+    std::unique_ptr<zerocopy_tracker> zerocopy;   // null unless --zerocopy
+    std::size_t max_iovecs = max_segments;        // per message
+    transmit_stats stats;
+
+public:
+    typedef basic_collector collector_type;
+
+    gso_transmit(const options &opts, boost::asio::io_service &io_service);
+    ~gso_transmit();
+
+    collector_type &get_collector() { return collector; }
+    void send_packets(std::size_t first, std::size_t last, time_point start);
+    void flush();
+    const transmit_stats &get_stats() const { return stats; }
+};
+
+#endif // HAVE_SENDMMSG && HAVE_DECL_UDP_SEGMENT
+#endif // UDPREPLAY_GSO_TRANSMIT_H
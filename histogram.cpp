@@ -0,0 +1,78 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <cmath>
+#include "histogram.h"
+
+std::uint64_t histogram::bucket_max(std::size_t idx)
+{
+    if (idx < sub_buckets)
+        return idx;
+    int shift = (idx >> sub_bits) - 1;
+    std::uint64_t lower = (sub_buckets + (idx & (sub_buckets - 1))) << shift;
+    return lower + (std::uint64_t(1) << shift) - 1;
+}
+
+std::chrono::nanoseconds histogram::percentile(double pct) const
+{
+    std::uint64_t rank = std::ceil(total * pct / 100.0);
+    rank = std::max(rank, std::uint64_t(1));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::chrono::nanoseconds(std::min(bucket_max(i), max_ns));
+    }
+    return max();
+}
+
+histogram &histogram::operator+=(const histogram &other)
+{
+    if (other.counts.size() > counts.size())
+        counts.resize(other.counts.size());
+    for (std::size_t i = 0; i < other.counts.size(); i++)
+        counts[i] += other.counts[i];
+    total += other.total;
+    max_ns = std::max(max_ns, other.max_ns);
+    return *this;
+}
+
+histogram histogram::operator-(const histogram &other) const
+{
+    // other must be an earlier state of this histogram
+    histogram out = *this;
+    for (std::size_t i = 0; i < other.counts.size(); i++)
+        out.counts[i] -= other.counts[i];
+    out.total -= other.total;
+    return out;
+}
+
+void histogram::show(std::ostream &out) const
+{
+    static const double pcts[] = {50, 99, 99.9};
+    for (double pct : pcts)
+    {
+        std::chrono::duration<double, std::micro> value = percentile(pct);
+        out << "p" << pct << " " << value.count() << "us, ";
+    }
+    std::chrono::duration<double, std::micro> value = max();
+    out << "max " << value.count() << "us";
+}
+
+constexpr int histogram::sub_bits;
+constexpr std::uint64_t histogram::sub_buckets;
@@ -0,0 +1,79 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_HISTOGRAM_H
+#define UDPREPLAY_HISTOGRAM_H
+
+#include <config.h>
+#include <ostream>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/* Counts of durations, for finding percentiles. Values are in nanoseconds,
+ * in log-linear buckets: each power of two is split into sub_buckets
+ * equal parts, so a percentile is accurate to within 1/sub_buckets of its
+ * value over any range. Adding a value costs a few integer instructions.
+ * Negative values are counted as zero.
+ */
+class histogram
+{
+private:
+    static constexpr int sub_bits = 4;
+    static constexpr std::uint64_t sub_buckets = 1 << sub_bits;
+
+    std::vector<std::uint64_t> counts;  // grown as needed
+    std::uint64_t total = 0;
+    std::uint64_t max_ns = 0;           // over the whole run, even when subtracting
+
+    static std::size_t bucket(std::uint64_t ns)
+    {
+        if (ns < sub_buckets)
+            return ns;
+        int log = 63 - __builtin_clzll(ns);
+        int shift = log - sub_bits;
+        return ((shift + 1) << sub_bits) + ((ns >> shift) - sub_buckets);
+    }
+
+    /// Largest value that falls in bucket @a idx
+    static std::uint64_t bucket_max(std::size_t idx);
+
+public:
+    void add(std::chrono::nanoseconds value)
+    {
+        std::uint64_t ns = std::max(value.count(), std::chrono::nanoseconds::rep(0));
+        std::size_t idx = bucket(ns);
+        if (idx >= counts.size())
+            counts.resize(idx + 1);
+        counts[idx]++;
+        total++;
+        max_ns = std::max(max_ns, ns);
+    }
+
+    std::uint64_t count() const { return total; }
+    std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(max_ns); }
+    /// Smallest value that at least @a pct percent of the values do not exceed
+    std::chrono::nanoseconds percentile(double pct) const;
+
+    histogram &operator+=(const histogram &other);
+    histogram operator-(const histogram &other) const;
+    /// Print the median, tail percentiles and maximum, in microseconds
+    void show(std::ostream &out) const;
+};
+
+#endif // UDPREPLAY_HISTOGRAM_H
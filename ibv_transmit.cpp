@@ -19,6 +19,7 @@
 #if HAVE_IBV
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <cstring>
 #include <cassert>
@@ -26,107 +27,15 @@
 #include <stdexcept>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <net/ethernet.h>
-#include <net/if_arp.h>
-#include <netpacket/packet.h>
 #include "ibv_transmit.h"
 
 using boost::asio::ip::udp;
 
-static mac_address multicast_mac(const boost::asio::ip::address_v4 &address)
-{
-    if (!address.is_multicast())
-        throw std::runtime_error("Address must be multicast for --mode=ibv");
-    mac_address ans;
-    auto bytes = address.to_bytes();
-    std::memcpy(&ans[2], &bytes, 4);
-    ans[0] = 0x01;
-    ans[1] = 0x00;
-    ans[2] = 0x5e;
-    ans[3] &= 0x7f;
-    return ans;
-}
-
-// Finds the MAC address corresponding to an interface IP address
-static std::array<unsigned char, 6> get_mac(const boost::asio::ip::address &address)
-{
-    ifaddrs *ifap;
-    if (getifaddrs(&ifap) < 0)
-        throw std::system_error(errno, std::system_category(), "getifaddrs failed");
-    std::unique_ptr<ifaddrs, freeifaddrs_deleter> ifap_owner(ifap);
-
-    // Map address to an interface name
-    char *if_name = nullptr;
-    for (ifaddrs *cur = ifap; cur; cur = cur->ifa_next)
-    {
-        if (cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_INET && address.is_v4())
-        {
-            const sockaddr_in *cur_address = (const sockaddr_in *) cur->ifa_addr;
-            const auto expected = address.to_v4().to_bytes();
-            if (memcmp(&cur_address->sin_addr, &expected, sizeof(expected)) == 0)
-            {
-                if_name = cur->ifa_name;
-                break;
-            }
-        }
-        else if (cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_INET6 && address.is_v6())
-        {
-            const sockaddr_in6 *cur_address = (const sockaddr_in6 *) cur->ifa_addr;
-            const auto expected = address.to_v6().to_bytes();
-            if (memcmp(&cur_address->sin6_addr, &expected, sizeof(expected)) == 0)
-            {
-                if_name = cur->ifa_name;
-                break;
-            }
-        }
-    }
-    if (!if_name)
-    {
-        throw std::runtime_error("no interface found with the address " + address.to_string());
-    }
-
-    // Now find the MAC address for this interface
-    for (ifaddrs *cur = ifap; cur; cur = cur->ifa_next)
-    {
-        if (strcmp(cur->ifa_name, if_name) == 0
-            && cur->ifa_addr && *(sa_family_t *) cur->ifa_addr == AF_PACKET)
-        {
-            const sockaddr_ll *ll = (sockaddr_ll *) cur->ifa_addr;
-            if (ll->sll_hatype == ARPHRD_ETHER && ll->sll_halen == 6)
-            {
-                std::array<unsigned char, 6> mac;
-                std::memcpy(&mac, ll->sll_addr, 6);
-                return mac;
-            }
-        }
-    }
-    throw std::runtime_error(std::string("no MAC address found for interface ") + if_name);
-}
-
-static std::uint16_t ip_checksum(const std::uint8_t *header)
-{
-    std::uint32_t sum = 0;
-    for (int i = 0; i < 20; i += 2)
-    {
-        if (i == 10)
-            continue;   // skip the checksum itself
-        std::uint16_t word;
-        std::memcpy(&word, header + i, sizeof(word));
-        sum += ntohs(word);
-    }
-    while (sum > 0xffff)
-        sum = (sum & 0xffff) + (sum >> 16);
-    return ~htons(sum);
-}
-
 static std::unique_ptr<std::uint8_t[], mmap_deleter<std::uint8_t>>
 allocate_huge(std::size_t size)
 {
-    /* Note: this use of a static variable makes this function
-     * non-threadsafe. If it is even going to be used by multiple
-     * threads, it needs to be replaced by something thread-safe.
-     */
-    static bool huge_failed = false;
+    // Atomic because collectors may be filled by several loader threads
+    static std::atomic<bool> huge_failed{false};
     const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
     std::uint8_t *ptr = (std::uint8_t *) MAP_FAILED;
     if (!huge_failed)
@@ -156,70 +65,37 @@ ibv_collector::slab::slab(ibv_pd *pd, std::size_t capacity)
 }
 
 ibv_collector::ibv_collector(
-    ibv_pd *pd,
-    const boost::asio::ip::udp::endpoint &src_endpoint,
-    const mac_address &src_mac, std::uint8_t ttl,
-    std::size_t slab_size)
-    : pd(pd), src_endpoint(src_endpoint), src_mac(src_mac),
-    ttl(ttl ? ttl : 1),
-    slab_size(slab_size)
+    ibv_pd *pd, const frame_builder &builder, std::size_t slab_size)
+    : pd(pd), builder(builder), slab_size(slab_size)
 {
 }
 
 void ibv_collector::add_packet(const packet &pkt)
 {
-    constexpr std::size_t header_size = 42;
-    std::size_t raw_size = pkt.len + header_size;
+    std::size_t raw_size = pkt.len + frame_builder::header_size;
 
-    if (slabs.empty() || slabs.back().capacity - slabs.back().used < raw_size)
+    while (cur_slab < slabs.size() && slabs[cur_slab].capacity - slabs[cur_slab].used < raw_size)
+        cur_slab++;
+    if (cur_slab == slabs.size())
     {
         std::size_t alloc_size = std::max(slab_size, raw_size);
         slabs.emplace_back(pd, alloc_size);
     }
-    std::uint8_t *data = slabs.back().data.get() + slabs.back().used;
-    slabs.back().used += raw_size;
+    slab &s = slabs[cur_slab];
+    std::uint8_t *data = s.data.get() + s.used;
+    s.used += raw_size;
 
     boost::asio::ip::address_v4::bytes_type dst_addr;
     std::memcpy(&dst_addr, &pkt.dst_host, sizeof(dst_addr));
-    mac_address dst_mac = multicast_mac(boost::asio::ip::address_v4(dst_addr));
-
-    memset(data, 0, 42); // Headers
-    // Ethernet header
-    std::uint8_t *ether = data;
-    std::memcpy(ether + 0, &dst_mac, sizeof(dst_mac));
-    std::memcpy(ether + 6, &src_mac, sizeof(src_mac));
-    ether[12] = 0x08; // ETHERTYPE_IP
-    ether[13] = 0x00;
-
-    // IP header
-    std::uint8_t *ip = ether + 14;
-    ip[0] = 0x45;  // Version 4, header length 20
-    ip[8] = ttl;
-    ip[9] = 0x11;  // Protocol: UDP
-    auto src_addr = src_endpoint.address().to_v4().to_bytes();
-    std::uint16_t length_ip = htons(pkt.len + 28);
-    std::memcpy(ip + 2, &length_ip, sizeof(length_ip));
-    std::memcpy(ip + 12, &src_addr, sizeof(src_addr));
-    std::memcpy(ip + 16, &dst_addr, sizeof(dst_addr));
-    std::uint16_t checksum = ip_checksum(ip);
-    std::memcpy(ip + 10, &checksum, sizeof(checksum));
-
-    // UDP header
-    std::uint8_t *udp = ip + 20;
-    std::uint16_t src_port_be = htons(src_endpoint.port());
-    std::uint16_t dst_port_be = pkt.dst_port;
-    std::uint16_t length_udp = htons(pkt.len + 8);
-    std::memcpy(udp + 0, &src_port_be, sizeof(src_port_be));
-    std::memcpy(udp + 2, &dst_port_be, sizeof(dst_port_be));
-    std::memcpy(udp + 4, &length_udp, sizeof(length_udp));
-
-    // Payload
-    std::memcpy(udp + 8, pkt.data, pkt.len);
+    boost::asio::ip::address_v4 dst(dst_addr);
+    if (!dst.is_multicast())
+        throw std::runtime_error("Address must be multicast for --mode=ibv");
+    builder.build(data, pkt, multicast_mac(dst));
 
     frames.emplace_back();
     frame &f = frames.back();
     f.sge.addr = (std::uintptr_t) data;
-    f.sge.lkey = slabs.back().mr->lkey;
+    f.sge.lkey = s.mr->lkey;
     f.sge.length = raw_size;
     f.wr.sg_list = &f.sge;
     f.wr.num_sge = 1;
@@ -254,6 +130,41 @@ std::size_t ibv_collector::bytes() const
     return total_bytes;
 }
 
+void ibv_collector::clear()
+{
+    frames.clear();
+    for (slab &s : slabs)
+        s.used = 0;
+    cur_slab = 0;
+    total_bytes = 0;
+}
+
+std::unique_ptr<ibv_collector> ibv_collector::clone_empty() const
+{
+    return std::unique_ptr<ibv_collector>(new ibv_collector(pd, builder, slab_size));
+}
+
+void ibv_collector::append(ibv_collector &&other)
+{
+    for (const frame &f : other.frames)
+    {
+        frames.emplace_back();
+        frame &g = frames.back();
+        g.sge = f.sge;
+        g.wr = f.wr;
+        g.wr.sg_list = &g.sge;
+        g.packet_size = f.packet_size;
+        g.timestamp = f.timestamp;
+    }
+    for (slab &s : other.slabs)
+        slabs.push_back(std::move(s));
+    total_bytes += other.total_bytes;
+    other.frames.clear();
+    other.slabs.clear();
+    other.cur_slab = 0;
+    other.total_bytes = 0;
+}
+
 void ibv_transmit::modify_state(ibv_qp_state state, int port_num)
 {
     int flags = IBV_QP_STATE;
@@ -344,9 +255,8 @@ ibv_transmit::ibv_transmit(const options &opts, boost::asio::io_service &io_serv
     modify_state(IBV_QPS_RTR);
     modify_state(IBV_QPS_RTS);
 
-    collector.reset(new ibv_collector(
-            pd.get(), src_endpoint,
-            get_mac(src_endpoint.address()), opts.ttl));
+    frame_builder builder(src_endpoint, get_interface(src_endpoint.address()).mac, opts.ttl);
+    collector.reset(new ibv_collector(pd.get(), builder));
 }
 
 void ibv_transmit::send_packets(std::size_t first, std::size_t last,
@@ -386,7 +296,13 @@ void ibv_transmit::send_packets(std::size_t first, std::size_t last,
     }
     prev->next = nullptr;
 
-    wait_for_wc(last - first);
+    if (slots < last - first)
+    {
+        auto wait_start = std::chrono::high_resolution_clock::now();
+        wait_for_wc(last - first);
+        stats.stalls++;
+        stats.blocked += std::chrono::high_resolution_clock::now() - wait_start;
+    }
     slots -= last - first;
 
     ibv_send_wr *bad;
@@ -31,17 +31,10 @@
 #include <boost/asio.hpp>
 #include <rdma/rdma_cma.h>
 #include <infiniband/verbs.h>
-#include <ifaddrs.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include "common.h"
-
-typedef std::array<std::uint8_t, 6> mac_address;
-
-struct freeifaddrs_deleter
-{
-    void operator()(ifaddrs *ifa) const { freeifaddrs(ifa); }
-};
+#include "frame_builder.h"
 
 struct mr_deleter
 {
@@ -111,28 +104,32 @@ private:
     };
 
     ibv_pd *pd;
-    boost::asio::ip::udp::endpoint src_endpoint;
-    mac_address src_mac;
-    std::uint8_t ttl;
+    frame_builder builder;
     // Cannot use a vector, because it is non-copyable
     std::deque<frame> frames;
     std::vector<slab> slabs;
+    std::size_t cur_slab = 0;   // first slab that may still have space
     std::size_t slab_size;
     std::size_t total_bytes = 0;
 
 public:
     explicit ibv_collector(
         ibv_pd *pd,
-        const boost::asio::ip::udp::endpoint &src_endpoint,
-        const mac_address &src_mac,
-        std::uint8_t ttl,
+        const frame_builder &builder,
         std::size_t slab_size = 64 * 1024 * 1024);
 
     void add_packet(const packet &pkt);
+    // Payloads are always copied into the frames, so nothing needs to be kept
+    void keep_alive(std::shared_ptr<const void> owner) {}
     std::size_t num_packets() const;
     std::size_t packet_size(std::size_t idx) const;
     duration packet_timestamp(std::size_t idx) const;
     std::size_t bytes() const;
+    void clear();   // remove all packets, but keep the registered memory
+    /// Create an empty collector with the same parameters
+    std::unique_ptr<ibv_collector> clone_empty() const;
+    /// Move all the frames (and their memory) from @a other to the end of this collector
+    void append(ibv_collector &&other);
     frame &get_frame(std::size_t idx);
 };
 
@@ -151,6 +148,7 @@ private:
     boost::asio::ip::udp::socket socket; // only to allocate a port number
     std::size_t slots = depth;
     std::unique_ptr<ibv_collector> collector;
+    transmit_stats stats;
 
     void modify_state(ibv_qp_state state, int port_num = -1);
     void wait_for_wc(std::size_t min_slots);
@@ -163,6 +161,7 @@ public:
     collector_type &get_collector() { return *collector; }
     void send_packets(std::size_t first, std::size_t last, time_point start);
     void flush();
+    const transmit_stats &get_stats() const { return stats; }
 };
 
 #endif // HAVE_IBV
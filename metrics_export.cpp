@@ -0,0 +1,187 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+#include <unistd.h>
+#include <boost/asio.hpp>
+#include "metrics_export.h"
+
+using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+class metrics_exporter::server_base
+{
+public:
+    virtual ~server_base() = default;
+};
+
+/* Serves the current page to every HTTP request, whatever its path. Runs
+ * entirely in the exporter's thread.
+ */
+template<typename Protocol>
+class metrics_exporter::server : public metrics_exporter::server_base
+{
+private:
+    struct session
+    {
+        typename Protocol::socket socket;
+        boost::asio::streambuf request;
+        std::string response;
+
+        explicit session(boost::asio::io_service &io_service) : socket(io_service) {}
+    };
+
+    metrics_exporter &owner;
+    typename Protocol::acceptor acceptor;
+
+    void accept()
+    {
+        auto s = std::make_shared<session>(owner.io_service);
+        acceptor.async_accept(s->socket, [this, s](const boost::system::error_code &ec)
+        {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (!ec)
+                respond(s);
+            accept();
+        });
+    }
+
+    void respond(std::shared_ptr<session> s)
+    {
+        boost::asio::async_read_until(s->socket, s->request, "\r\n\r\n",
+            [this, s](const boost::system::error_code &ec, std::size_t)
+        {
+            if (ec)
+                return;
+            std::string body = owner.get_page();
+            s->response = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n" + body;
+            // The session lives until the write completes, and closes on destruction
+            boost::asio::async_write(s->socket, boost::asio::buffer(s->response),
+                                     [s](const boost::system::error_code &, std::size_t) {});
+        });
+    }
+
+public:
+    server(metrics_exporter &owner, const typename Protocol::endpoint &endpoint)
+        : owner(owner), acceptor(owner.io_service, endpoint)
+    {
+        accept();
+    }
+};
+
+metrics_exporter::metrics_exporter(
+    const std::string &prefix, const std::string &json_path, const std::string &listen)
+    : prefix(prefix)
+{
+    if (json_path == "-")
+        json = &std::cout;
+    else if (!json_path.empty())
+    {
+        json_file.reset(new std::ofstream(json_path, std::ios::app));
+        if (!*json_file)
+            throw std::runtime_error("Could not open " + json_path);
+        json = json_file.get();
+    }
+
+    if (listen.empty())
+        return;
+    if (listen.compare(0, 5, "unix:") == 0)
+    {
+        std::string path = listen.substr(5);
+        unlink(path.c_str());   // left behind by an earlier run
+        http.reset(new server<stream_protocol>(*this, stream_protocol::endpoint(path)));
+    }
+    else
+    {
+        std::string host = "127.0.0.1";
+        std::string port = listen;
+        std::string::size_type colon = listen.rfind(':');
+        if (colon != std::string::npos)
+        {
+            host = listen.substr(0, colon);
+            port = listen.substr(colon + 1);
+        }
+        tcp::resolver resolver(io_service);
+        tcp::resolver::query query(host, port, tcp::resolver::query::passive);
+        http.reset(new server<tcp>(*this, *resolver.resolve(query)));
+    }
+    thread = std::thread([this] { io_service.run(); });
+}
+
+metrics_exporter::~metrics_exporter()
+{
+    if (thread.joinable())
+    {
+        io_service.stop();
+        thread.join();
+    }
+}
+
+bool metrics_exporter::json_on_stdout() const
+{
+    return json == &std::cout;
+}
+
+std::string metrics_exporter::get_page()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return page;
+}
+
+void metrics_exporter::publish(const std::vector<metric> &metrics)
+{
+    if (json)
+    {
+        std::chrono::duration<double> now = std::chrono::system_clock::now().time_since_epoch();
+        std::ostringstream line;
+        line << std::setprecision(15) << "{\"time\": " << now.count();
+        for (const metric &m : metrics)
+        {
+            line << ", \"" << m.name << "\": ";
+            if (std::isfinite(m.value))
+                line << m.value;
+            else
+                line << "null";     // JSON has no infinities or NaNs
+        }
+        line << "}\n";
+        *json << line.str() << std::flush;
+    }
+    if (http)
+    {
+        std::ostringstream text;
+        text << std::setprecision(15);
+        for (const metric &m : metrics)
+        {
+            std::string name = prefix + '_' + m.name;
+            text << "# HELP " << name << ' ' << m.help << '\n'
+                << "# TYPE " << name << ' ' << m.type << '\n'
+                << name << ' ' << m.value << '\n';
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        page = text.str();
+    }
+}
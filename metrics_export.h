@@ -0,0 +1,87 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_METRICS_EXPORT_H
+#define UDPREPLAY_METRICS_EXPORT_H
+
+#include <config.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <ostream>
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+
+/// A single value to export
+struct metric
+{
+    std::string name;       // without the program prefix
+    const char *type;       // Prometheus type: "counter" or "gauge"
+    const char *help;
+    double value;
+};
+
+/* Publishes metrics in machine-readable forms, for use by both udpreplay
+ * and udpcount. Each call to @ref publish writes the metrics as one JSON
+ * object per line (if a JSON output was given), and replaces the set that
+ * is served in the Prometheus text format over HTTP (if a listen address
+ * was given). The server runs in its own thread; the only synchronisation
+ * is between it and the publishing thread, so the counters themselves are
+ * read however the caller already reads them for its text output.
+ */
+class metrics_exporter : public boost::noncopyable
+{
+private:
+    class server_base;
+    template<typename Protocol> class server;
+
+    const std::string prefix;
+    std::unique_ptr<std::ostream> json_file;
+    std::ostream *json = nullptr;
+
+    boost::asio::io_service io_service;
+    std::unique_ptr<server_base> http;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::string page;       // most recently published metrics, in text format
+
+    /// Current page to serve (thread-safe)
+    std::string get_page();
+
+public:
+    /**
+     * Set up the outputs. @a prefix is prepended to every metric name (with
+     * an underscore). @a json_path is a file to append JSON lines to, "-"
+     * for stdout or empty for none. @a listen is empty for no server,
+     * "unix:PATH" for a Unix socket, or "[HOST:]PORT" for TCP (on the
+     * loopback interface if no host is given).
+     */
+    metrics_exporter(const std::string &prefix, const std::string &json_path,
+                     const std::string &listen);
+    ~metrics_exporter();
+
+    /// Whether metrics go anywhere at all
+    bool enabled() const { return json != nullptr || http != nullptr; }
+    /// Whether JSON lines are written to stdout, in place of text reports
+    bool json_on_stdout() const;
+
+    void publish(const std::vector<metric> &metrics);
+};
+
+#endif // UDPREPLAY_METRICS_EXPORT_H
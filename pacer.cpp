@@ -0,0 +1,80 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <chrono>
+#include <algorithm>
+#include <ctime>
+#include "pacer.h"
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+pacer::pacer(const options &opts)
+    : spin_threshold(std::chrono::duration_cast<duration>(
+        std::chrono::duration<double, std::micro>(opts.spin_threshold)))
+{
+}
+
+std::int64_t pacer::raw_now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+time_point pacer::wait_until(time_point deadline, duration &waited)
+{
+    time_point now = time_point::clock::now();
+    if (now >= deadline)
+    {
+        waited = duration::zero();
+        return now;
+    }
+    /* The deadline is converted to the raw clock once, so that spinning
+     * only needs that clock.
+     */
+    std::chrono::nanoseconds remaining = deadline - now;
+    std::int64_t raw_start = raw_now();
+    std::int64_t raw_deadline = raw_start + remaining.count();
+    std::int64_t raw = raw_start;
+    if (remaining > spin_threshold)
+    {
+        /* Sleep in slices of at most 100ms, so that an interrupt is noticed
+         * promptly even if it is delivered to another thread.
+         */
+        std::int64_t raw_wake = raw_deadline - std::chrono::nanoseconds(spin_threshold).count();
+        while (raw < raw_wake && !interrupted())
+        {
+            std::int64_t sleep = std::min(raw_wake - raw, std::int64_t(100000000));
+            timespec req;
+            req.tv_sec = sleep / 1000000000;
+            req.tv_nsec = sleep % 1000000000;
+            nanosleep(&req, nullptr);
+            raw = raw_now();
+        }
+    }
+    while ((raw = raw_now()) < raw_deadline && !interrupted())
+        cpu_relax();
+    waited = std::chrono::duration_cast<duration>(std::chrono::nanoseconds(raw - raw_start));
+    return now + waited;
+}
@@ -0,0 +1,49 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_PACER_H
+#define UDPREPLAY_PACER_H
+
+#include <config.h>
+#include <cstdint>
+#include "common.h"
+
+/* Waits for send times more precisely than a timer can. A sleep typically
+ * overshoots by tens of microseconds, so the pacer sleeps only until the
+ * deadline is within the spin threshold, and then polls
+ * CLOCK_MONOTONIC_RAW (which is read without a system call and is not
+ * slewed by NTP) until it arrives.
+ */
+class pacer
+{
+private:
+    duration spin_threshold;
+
+    /// CLOCK_MONOTONIC_RAW, in nanoseconds
+    static std::int64_t raw_now();
+
+public:
+    explicit pacer(const options &opts);
+
+    /**
+     * Wait until @a deadline, returning the time at which the wait ended.
+     * The time spent waiting is stored in @a waited. The wait ends early
+     * if @ref interrupted becomes true.
+     */
+    time_point wait_until(time_point deadline, duration &waited);
+};
+
+#endif // UDPREPLAY_PACER_H
@@ -0,0 +1,293 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <cstring>
+#include <system_error>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "pcap_file.h"
+
+static constexpr std::uint32_t magic_micro = 0xa1b2c3d4;
+static constexpr std::uint32_t magic_nano = 0xa1b23c4d;
+
+mapped_capture::mapped_capture(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "could not open " + filename);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::system_error(err, std::system_category(), "fstat failed");
+    }
+    length = st.st_size;
+    if (length < file_header_size)
+    {
+        close(fd);
+        throw std::runtime_error(filename + " is not a pcap file");
+    }
+    void *ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw std::system_error(err, std::system_category(), "mmap failed");
+    std::size_t map_length = length;
+    data.reset((const std::uint8_t *) ptr,
+               [map_length](const std::uint8_t *p) { munmap((void *) p, map_length); });
+    madvise(ptr, length, MADV_SEQUENTIAL);
+
+    std::uint32_t magic;
+    std::memcpy(&magic, data.get(), sizeof(magic));
+    swapped = false;
+    if (magic == __builtin_bswap32(magic_micro) || magic == __builtin_bswap32(magic_nano))
+    {
+        swapped = true;
+        magic = __builtin_bswap32(magic);
+    }
+    if (magic == magic_micro)
+        nano = false;
+    else if (magic == magic_nano)
+        nano = true;
+    else
+        throw std::runtime_error(filename + " is not in pcap format (pcapng cannot be used with --mmap)");
+    linktype = read32(20) & 0xffff;   // upper bits hold FCS information
+    rewind();
+}
+
+std::uint32_t mapped_capture::read32(std::size_t pos) const
+{
+    std::uint32_t value;
+    std::memcpy(&value, data.get() + pos, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+bool mapped_capture::read(std::size_t &pos, pcap_pkthdr &header, const std::uint8_t *&bytes) const
+{
+    if (length - pos < record_header_size)
+    {
+        if (pos != length)
+            std::cerr << "Warning: capture ends with a partial record header\n";
+        pos = length;
+        return false;
+    }
+    std::uint32_t caplen = read32(pos + 8);
+    if (length - pos - record_header_size < caplen)
+    {
+        std::cerr << "Warning: capture ends with a partial record\n";
+        pos = length;
+        return false;
+    }
+    header.ts.tv_sec = read32(pos);
+    header.ts.tv_usec = read32(pos + 4);
+    if (!nano)
+        header.ts.tv_usec *= 1000;
+    header.caplen = caplen;
+    header.len = read32(pos + 12);
+    bytes = data.get() + pos + record_header_size;
+    pos += record_header_size + caplen;
+    return true;
+}
+
+bool mapped_capture::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    return read(offset, header, bytes);
+}
+
+void mapped_capture::rewind()
+{
+    offset = file_header_size;
+}
+
+constexpr std::size_t mapped_capture::file_header_size;
+constexpr std::size_t mapped_capture::record_header_size;
+
+
+capture_filter::capture_filter(int linktype, const std::string &expression)
+{
+    pcap_t *dead = pcap_open_dead_with_tstamp_precision(
+        linktype, 65535, PCAP_TSTAMP_PRECISION_NANO);
+    if (dead == NULL)
+        throw std::runtime_error("pcap_open_dead failed");
+    int status = pcap_compile(dead, &program, expression.c_str(), 1, PCAP_NETMASK_UNKNOWN);
+    if (status == -1)
+    {
+        std::string msg = std::string("Failed to parse filter: ") + pcap_geterr(dead);
+        pcap_close(dead);
+        throw std::runtime_error(msg);
+    }
+    pcap_close(dead);
+}
+
+capture_filter::~capture_filter()
+{
+    pcap_freecode(&program);
+}
+
+bool capture_filter::operator()(const pcap_pkthdr &header, const std::uint8_t *bytes) const
+{
+    return pcap_offline_filter(&program, &header, bytes) != 0;
+}
+
+
+pcap_source::pcap_source(const std::string &filename)
+{
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *raw = pcap_open_offline_with_tstamp_precision(
+        filename.c_str(), PCAP_TSTAMP_PRECISION_NANO, errbuf);
+    if (raw == NULL)
+        throw std::runtime_error(errbuf);
+    p.reset(raw, pcap_close);
+    if (pcap_datalink(raw) != DLT_EN10MB)
+        throw std::runtime_error("Capture does not contain Ethernet frames");
+}
+
+bool pcap_source::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    pcap_pkthdr *h;
+    int status = pcap_next_ex(p.get(), &h, &bytes);
+    if (status == 1)
+    {
+        header = *h;
+        return true;
+    }
+    else if (status == -2)
+        return false;
+    else
+        throw std::runtime_error(pcap_geterr(p.get()));
+}
+
+
+mapped_source::mapped_source(const std::string &filename)
+    : cap(filename)
+{
+    if (cap.datalink() != DLT_EN10MB)
+        throw std::runtime_error("Capture does not contain Ethernet frames");
+}
+
+bool mapped_source::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    return cap.next(header, bytes);
+}
+
+
+filtered_source::filtered_source(std::unique_ptr<frame_source> &&input, const std::string &expression)
+    : input(std::move(input)), filter(DLT_EN10MB, expression)
+{
+}
+
+bool filtered_source::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    while (input->next(header, bytes))
+    {
+        if (filter(header, bytes))
+            return true;
+    }
+    return false;
+}
+
+
+range_source::range_source(std::unique_ptr<frame_source> &&input, const frame_range &range)
+    : input(std::move(input)), range(range)
+{
+}
+
+bool range_source::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    while (!finished && input->next(header, bytes))
+    {
+        if (index == 0)
+            origin = header.ts;
+        std::uint64_t cur = index++;
+        std::chrono::nanoseconds time = frame_range::offset(origin, header.ts);
+        if (!started)
+        {
+            if (range.before_start(cur, time))
+                continue;
+            started = true;
+        }
+        if (range.past_end(cur, time))
+            finished = true;
+        else
+            return true;
+    }
+    return false;
+}
+
+
+bool merged_source::head::operator>(const head &other) const
+{
+    if (header.ts.tv_sec != other.header.ts.tv_sec)
+        return header.ts.tv_sec > other.header.ts.tv_sec;
+    if (header.ts.tv_usec != other.header.ts.tv_usec)
+        return header.ts.tv_usec > other.header.ts.tv_usec;
+    return input > other.input;
+}
+
+merged_source::merged_source(std::vector<std::unique_ptr<frame_source>> &&inputs)
+    : inputs(std::move(inputs)), advance(this->inputs.size())
+{
+    auto all_owners = std::make_shared<std::vector<std::shared_ptr<const void>>>();
+    for (const auto &input : this->inputs)
+    {
+        auto owner = input->owner();
+        if (!owner)
+        {
+            all_owners.reset();
+            break;
+        }
+        all_owners->push_back(std::move(owner));
+    }
+    owners = all_owners;
+    for (std::size_t i = 0; i < this->inputs.size(); i++)
+        fetch(i);
+}
+
+void merged_source::fetch(std::size_t input)
+{
+    head h;
+    if (inputs[input]->next(h.header, h.bytes))
+    {
+        h.input = input;
+        heap.push_back(h);
+        std::push_heap(heap.begin(), heap.end(), std::greater<head>());
+    }
+}
+
+bool merged_source::next(pcap_pkthdr &header, const std::uint8_t *&bytes)
+{
+    if (advance < inputs.size())
+    {
+        fetch(advance);
+        advance = inputs.size();
+    }
+    if (heap.empty())
+        return false;
+    std::pop_heap(heap.begin(), heap.end(), std::greater<head>());
+    header = heap.back().header;
+    bytes = heap.back().bytes;
+    advance = heap.back().input;
+    heap.pop_back();
+    return true;
+}
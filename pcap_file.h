@@ -0,0 +1,231 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_PCAP_FILE_H
+#define UDPREPLAY_PCAP_FILE_H
+
+#include <config.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <limits>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <pcap.h>
+
+/* Reads a capture in the classic pcap file format by memory-mapping it, so
+ * that frames can be used in place rather than copied. Other formats
+ * (such as pcapng) must be read through libpcap.
+ */
+class mapped_capture : public boost::noncopyable
+{
+private:
+    std::shared_ptr<const std::uint8_t> data;
+    std::size_t length;
+    std::size_t offset;       // position of the next record
+    bool swapped;
+    bool nano;
+    int linktype;
+
+    std::uint32_t read32(std::size_t pos) const;
+
+public:
+    static constexpr std::size_t file_header_size = 24;
+    static constexpr std::size_t record_header_size = 16;
+
+    explicit mapped_capture(const std::string &filename);
+
+    int datalink() const { return linktype; }
+    /// Handle that keeps the mapping alive after this object is destroyed
+    std::shared_ptr<const void> owner() const { return data; }
+
+    /**
+     * Fetch the next record. As with PCAP_TSTAMP_PRECISION_NANO, the
+     * tv_usec field of the timestamp holds nanoseconds. Returns false at
+     * the end of the capture.
+     */
+    bool next(pcap_pkthdr &header, const std::uint8_t *&bytes);
+    /// Return to the first record
+    void rewind();
+
+    /**
+     * Fetch the record at byte offset @a pos, and advance @a pos to the
+     * next record. Unlike @ref next, this does not modify the object, so it
+     * may be used by several threads at once.
+     */
+    bool read(std::size_t &pos, pcap_pkthdr &header, const std::uint8_t *&bytes) const;
+    /// Byte offset of the first record
+    std::size_t begin() const { return file_header_size; }
+    /// Byte offset of the end of the capture
+    std::size_t end() const { return length; }
+};
+
+/// Compiled BPF filter, which can be applied to frames from any source
+class capture_filter : public boost::noncopyable
+{
+private:
+    bpf_program program;
+
+public:
+    capture_filter(int linktype, const std::string &expression);
+    ~capture_filter();
+
+    bool operator()(const pcap_pkthdr &header, const std::uint8_t *bytes) const;
+};
+
+/// Sequence of captured UDP frames
+class frame_source : public boost::noncopyable
+{
+public:
+    virtual ~frame_source() = default;
+
+    /**
+     * Fetch the next frame. As with PCAP_TSTAMP_PRECISION_NANO, the tv_usec
+     * field of the timestamp holds nanoseconds. The frame remains valid
+     * until the next call. Returns false at the end of the capture.
+     */
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) = 0;
+
+    /**
+     * If non-null, holding the returned handle keeps the data of all frames
+     * valid indefinitely.
+     */
+    virtual std::shared_ptr<const void> owner() const { return nullptr; }
+};
+
+/// Reads any capture format supported by libpcap
+class pcap_source : public frame_source
+{
+private:
+    std::shared_ptr<pcap_t> p;
+
+public:
+    explicit pcap_source(const std::string &filename);
+
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) override;
+};
+
+/// Reads a capture through @ref mapped_capture
+class mapped_source : public frame_source
+{
+private:
+    mapped_capture cap;
+
+public:
+    explicit mapped_source(const std::string &filename);
+
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) override;
+    virtual std::shared_ptr<const void> owner() const override { return cap.owner(); }
+};
+
+/// Passes on only the Ethernet frames that match a BPF filter expression
+class filtered_source : public frame_source
+{
+private:
+    std::unique_ptr<frame_source> input;
+    capture_filter filter;
+
+public:
+    filtered_source(std::unique_ptr<frame_source> &&input, const std::string &expression);
+
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) override;
+    virtual std::shared_ptr<const void> owner() const override { return input->owner(); }
+};
+
+/* A contiguous part of a capture. It starts at the first frame that is at
+ * or after both start bounds, and ends before the first subsequent frame
+ * that reaches either end bound. Frames are numbered from 0, and times are
+ * relative to the first frame of the capture.
+ */
+struct frame_range
+{
+    std::uint64_t start_index = 0;
+    std::uint64_t end_index = std::numeric_limits<std::uint64_t>::max();
+    std::chrono::nanoseconds start_time = std::chrono::nanoseconds::zero();
+    std::chrono::nanoseconds end_time = std::chrono::nanoseconds::max();
+
+    bool before_start(std::uint64_t index, std::chrono::nanoseconds time) const
+    {
+        return index < start_index || time < start_time;
+    }
+
+    bool past_end(std::uint64_t index, std::chrono::nanoseconds time) const
+    {
+        return index >= end_index || time >= end_time;
+    }
+
+    /// Time of @a ts relative to @a origin, where tv_usec holds nanoseconds
+    static std::chrono::nanoseconds offset(const timeval &origin, const timeval &ts)
+    {
+        return std::chrono::seconds(ts.tv_sec - origin.tv_sec)
+            + std::chrono::nanoseconds(ts.tv_usec - origin.tv_usec);
+    }
+};
+
+/* Passes on only the frames in a @ref frame_range. Reading stops at the end
+ * of the range, so the rest of the input is never read.
+ */
+class range_source : public frame_source
+{
+private:
+    std::unique_ptr<frame_source> input;
+    frame_range range;
+    std::uint64_t index = 0;
+    timeval origin;
+    bool started = false;
+    bool finished = false;
+
+public:
+    range_source(std::unique_ptr<frame_source> &&input, const frame_range &range);
+
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) override;
+    virtual std::shared_ptr<const void> owner() const override { return input->owner(); }
+};
+
+/**
+ * Merges several sources into timestamp order. Each input must itself be in
+ * timestamp order, and only one frame is held from each. Frames with equal
+ * timestamps are taken from the inputs in the order given.
+ */
+class merged_source : public frame_source
+{
+private:
+    struct head
+    {
+        pcap_pkthdr header;
+        const std::uint8_t *bytes;
+        std::size_t input;
+
+        bool operator>(const head &other) const;
+    };
+
+    std::vector<std::unique_ptr<frame_source>> inputs;
+    std::vector<head> heap;
+    std::size_t advance;   // input to advance before returning the next frame
+    std::shared_ptr<const void> owners;
+
+    void fetch(std::size_t input);
+
+public:
+    explicit merged_source(std::vector<std::unique_ptr<frame_source>> &&inputs);
+
+    virtual bool next(pcap_pkthdr &header, const std::uint8_t *&bytes) override;
+    virtual std::shared_ptr<const void> owner() const override { return owners; }
+};
+
+#endif // UDPREPLAY_PCAP_FILE_H
@@ -0,0 +1,261 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_LINUX_IF_PACKET_H
+
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+#include <stdexcept>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/ethernet.h>
+#include "pfpacket_transmit.h"
+
+typedef boost::asio::ip::udp udp;
+
+pfpacket_collector::pfpacket_collector(
+    const frame_builder &builder, std::shared_ptr<mac_resolver> resolver)
+    : builder(builder), resolver(std::move(resolver))
+{
+}
+
+void pfpacket_collector::add_packet(const packet &pkt)
+{
+    scratch.resize(frame_builder::header_size + pkt.len);
+    builder.build(scratch.data(), pkt, (*resolver)(pkt.dst_host));
+    packet f = pkt;
+    f.data = scratch.data();
+    f.len = scratch.size();
+    f.stable = false;
+    frames.add_packet(f);
+}
+
+std::size_t pfpacket_collector::num_packets() const
+{
+    return frames.num_packets();
+}
+
+std::size_t pfpacket_collector::packet_size(std::size_t idx) const
+{
+    return frames.packet_size(idx) - frame_builder::header_size;
+}
+
+duration pfpacket_collector::packet_timestamp(std::size_t idx) const
+{
+    return frames.packet_timestamp(idx);
+}
+
+std::size_t pfpacket_collector::bytes() const
+{
+    return frames.bytes() - frames.num_packets() * frame_builder::header_size;
+}
+
+void pfpacket_collector::clear()
+{
+    frames.clear();
+}
+
+std::unique_ptr<pfpacket_collector> pfpacket_collector::clone_empty() const
+{
+    return std::unique_ptr<pfpacket_collector>(new pfpacket_collector(builder, resolver));
+}
+
+void pfpacket_collector::append(pfpacket_collector &&other)
+{
+    frames.append(std::move(other.frames));
+}
+
+packet pfpacket_collector::get_frame(std::size_t idx) const
+{
+    return frames.get_packet(idx);
+}
+
+
+/* TPACKET_V2 is used rather than V3: the block-based layout of V3 only
+ * benefits the receive ring, and the transmit ring treats each frame
+ * individually in either case.
+ */
+static constexpr std::size_t data_offset = TPACKET2_HDRLEN - sizeof(sockaddr_ll);
+
+pfpacket_transmit::pfpacket_transmit(const options &opts, boost::asio::io_service &io_service)
+    : socket(io_service, udp::v4())
+{
+    if (opts.bind == "")
+        throw std::runtime_error("--bind must be specified with --mode=pfpacket");
+    auto src_address = boost::asio::ip::address::from_string(opts.bind);
+    if (!src_address.is_v4())
+        throw std::runtime_error("--mode=pfpacket only supports IPv4");
+    udp::endpoint src_endpoint(src_address, 0);
+    // Get the OS to assign us a source port
+    socket.bind(src_endpoint);
+    src_endpoint = socket.local_endpoint();
+    interface_info iface = get_interface(src_address);
+    max_frame = iface.mtu + sizeof(ether_header);
+
+    // Protocol 0 means that nothing is received on the socket
+    fd = ::socket(AF_PACKET, SOCK_RAW, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "socket(AF_PACKET) failed");
+    try
+    {
+        int version = TPACKET_V2;
+        if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+            throw std::system_error(errno, std::system_category(), "setsockopt(PACKET_VERSION) failed");
+        if (opts.qdisc_bypass)
+        {
+            int one = 1;
+            if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0)
+                throw std::system_error(errno, std::system_category(),
+                                        "setsockopt(PACKET_QDISC_BYPASS) failed");
+        }
+
+        // Slots must be a power of two in size, and blocks a multiple of the page size
+        frame_size = TPACKET_ALIGNMENT;
+        while (frame_size < data_offset + max_frame)
+            frame_size *= 2;
+        std::size_t block_size = std::max(frame_size, std::size_t(1024 * 1024));
+        tpacket_req req = {};
+        req.tp_block_size = block_size;
+        req.tp_block_nr = std::max(std::size_t(1), ring_size / block_size);
+        req.tp_frame_size = frame_size;
+        req.tp_frame_nr = req.tp_block_nr * (block_size / frame_size);
+        frame_count = req.tp_frame_nr;
+        if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+            throw std::system_error(errno, std::system_category(), "setsockopt(PACKET_TX_RING) failed");
+        void *ptr = mmap(nullptr, frame_count * frame_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "mmap failed");
+        ring = (std::uint8_t *) ptr;
+
+        sockaddr_ll addr = {};
+        addr.sll_family = AF_PACKET;
+        addr.sll_ifindex = iface.index;
+        if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) < 0)
+            throw std::system_error(errno, std::system_category(), "bind failed");
+    }
+    catch (...)
+    {
+        if (ring)
+            munmap(ring, frame_count * frame_size);
+        close(fd);
+        throw;
+    }
+
+    frame_builder builder(src_endpoint, iface.mac, opts.ttl);
+    std::shared_ptr<mac_resolver> resolver = std::make_shared<mac_resolver>(iface);
+    collector.reset(new pfpacket_collector(builder, resolver));
+}
+
+pfpacket_transmit::~pfpacket_transmit()
+{
+    munmap(ring, frame_count * frame_size);
+    close(fd);
+}
+
+tpacket2_hdr *pfpacket_transmit::get_slot(std::size_t idx)
+{
+    return (tpacket2_hdr *) (ring + idx * frame_size);
+}
+
+void pfpacket_transmit::kick(bool wait)
+{
+    while (send(fd, nullptr, 0, wait ? 0 : MSG_DONTWAIT) < 0)
+    {
+        /* ENOBUFS means that the device queue is full. The frames remain in
+         * the ring and are retried on the next call.
+         */
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+            return;
+        if (errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "send failed");
+    }
+}
+
+void pfpacket_transmit::wait_slot(std::size_t idx)
+{
+    tpacket2_hdr *hdr = get_slot(idx);
+    time_point wait_start;
+    for (int polls = 0; ; polls++)
+    {
+        std::uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (status == TP_STATUS_WRONG_FORMAT)
+            throw std::runtime_error("the kernel rejected a frame as malformed");
+        if (status == TP_STATUS_AVAILABLE)
+        {
+            if (polls > 0)
+            {
+                stats.stalls++;
+                stats.retries += polls - 1;
+                stats.blocked += std::chrono::high_resolution_clock::now() - wait_start;
+            }
+            return;
+        }
+        if (polls == 0)
+            wait_start = std::chrono::high_resolution_clock::now();
+        kick(false);
+        /* A short timeout is used because frames held back by a full device
+         * queue are only retried by another send.
+         */
+        pollfd pfd = {};
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, 1) < 0 && errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "poll failed");
+    }
+}
+
+void pfpacket_transmit::send_packets(std::size_t first, std::size_t last,
+                                     time_point start)
+{
+    (void) start; // unused
+    if (first == last)
+        return;
+    for (std::size_t i = first; i < last; i++)
+    {
+        packet f = collector->get_frame(i);
+        if (f.len > max_frame)
+            throw std::runtime_error(
+                "packet of " + std::to_string(f.len - frame_builder::header_size)
+                + " bytes exceeds the MTU (--mode=pfpacket cannot fragment)");
+        wait_slot(next_frame);
+        tpacket2_hdr *hdr = get_slot(next_frame);
+        std::memcpy((std::uint8_t *) hdr + data_offset, f.data, f.len);
+        hdr->tp_len = f.len;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        next_frame = (next_frame + 1) % frame_count;
+    }
+    kick(false);
+}
+
+void pfpacket_transmit::flush()
+{
+    kick(true);
+    // Slots are sent in order, so this covers everything queued
+    wait_slot((next_frame + frame_count - 1) % frame_count);
+}
+
+constexpr int pfpacket_transmit::batch_size;
+constexpr std::size_t pfpacket_transmit::ring_size;
+
+#endif // HAVE_LINUX_IF_PACKET_H
@@ -0,0 +1,101 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_PFPACKET_TRANSMIT_H
+#define UDPREPLAY_PFPACKET_TRANSMIT_H
+
+#include <config.h>
+
+#if HAVE_LINUX_IF_PACKET_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <linux/if_packet.h>
+#include "common.h"
+#include "frame_builder.h"
+
+/// Holds complete Ethernet frames, which are built as packets are added
+class pfpacket_collector
+{
+private:
+    basic_collector frames;
+    frame_builder builder;
+    std::shared_ptr<mac_resolver> resolver;
+    std::vector<std::uint8_t> scratch;
+
+public:
+    pfpacket_collector(const frame_builder &builder, std::shared_ptr<mac_resolver> resolver);
+
+    void add_packet(const packet &pkt);
+    // Payloads are always copied into the frames, so nothing needs to be kept
+    void keep_alive(std::shared_ptr<const void> owner) {}
+    std::size_t num_packets() const;
+    std::size_t packet_size(std::size_t idx) const;
+    duration packet_timestamp(std::size_t idx) const;
+    std::size_t bytes() const;
+    void clear();
+    /// Create an empty collector with the same parameters
+    std::unique_ptr<pfpacket_collector> clone_empty() const;
+    void append(pfpacket_collector &&other);
+    /// The complete frame for a packet (which is stable)
+    packet get_frame(std::size_t idx) const;
+};
+
+/* Sends frames through a PACKET_TX_RING on an AF_PACKET socket. Frames are
+ * copied into the ring and the kernel is asked to send all those queued
+ * with a single send() per batch.
+ */
+class pfpacket_transmit : public boost::noncopyable
+{
+public:
+    static constexpr int batch_size = 64;
+    static constexpr std::size_t ring_size = 16 * 1024 * 1024;
+
+private:
+    boost::asio::ip::udp::socket socket; // only to allocate a port number
+    int fd = -1;
+    std::uint8_t *ring = nullptr;
+    std::size_t frame_size;    // size of each slot in the ring
+    std::size_t frame_count;
+    std::size_t next_frame = 0;
+    std::size_t max_frame;     // largest frame the interface accepts
+    std::unique_ptr<pfpacket_collector> collector;
+    transmit_stats stats;
+
+    tpacket2_hdr *get_slot(std::size_t idx);
+    /// Ask the kernel to send the queued frames, optionally waiting for them
+    void kick(bool wait);
+    /// Wait until slot @a idx is no longer in use by the kernel
+    void wait_slot(std::size_t idx);
+
+public:
+    typedef pfpacket_collector collector_type;
+
+    pfpacket_transmit(const options &opts, boost::asio::io_service &io_service);
+    ~pfpacket_transmit();
+
+    collector_type &get_collector() { return *collector; }
+    void send_packets(std::size_t first, std::size_t last, time_point start);
+    void flush();
+    const transmit_stats &get_stats() const { return stats; }
+};
+
+#endif // HAVE_LINUX_IF_PACKET_H
+#endif // UDPREPLAY_PFPACKET_TRANSMIT_H
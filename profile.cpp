@@ -0,0 +1,238 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include "profile.h"
+
+constexpr double rate_profile::resolution;
+
+static double parse_number(const std::string &word, const std::string &item)
+{
+    std::istringstream in(word);
+    double value;
+    char extra;
+    if (!(in >> value) || in >> extra || !std::isfinite(value))
+        throw std::invalid_argument("invalid number '" + word + "' in profile segment '" + item + "'");
+    return value;
+}
+
+rate_profile::rate_profile(const std::string &spec)
+{
+    std::string items;
+    std::istringstream lines(spec);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        line = line.substr(0, line.find('#'));
+        items += line + ';';
+    }
+
+    std::istringstream item_stream(items);
+    std::string item;
+    bool positive = false;
+    while (std::getline(item_stream, item, ';'))
+    {
+        std::istringstream word_stream(item);
+        std::vector<std::string> words;
+        std::string word;
+        while (word_stream >> word)
+            words.push_back(word);
+        if (words.empty())
+            continue;
+
+        segment seg = {};
+        std::size_t params;
+        if (words[0] == "const")
+        {
+            seg.type = shape::constant;
+            params = 1;
+        }
+        else if (words[0] == "ramp")
+        {
+            seg.type = shape::ramp;
+            params = 2;
+        }
+        else if (words[0] == "steps")
+        {
+            seg.type = shape::steps;
+            params = 3;
+        }
+        else if (words[0] == "burst")
+        {
+            seg.type = shape::burst;
+            params = 4;
+        }
+        else if (words[0] == "sine")
+        {
+            seg.type = shape::sine;
+            params = 3;
+        }
+        else
+            throw std::invalid_argument("unknown profile shape '" + words[0] + "'");
+        if (words.size() != params + 2)
+            throw std::invalid_argument("profile segment '" + item + "' should have "
+                                        + std::to_string(params + 1) + " numbers");
+        seg.duration = parse_number(words[1], item);
+        for (std::size_t i = 0; i < params; i++)
+            seg.p[i] = parse_number(words[i + 2], item);
+
+        if (seg.duration <= 0)
+            throw std::invalid_argument("profile segment '" + item + "' must have a positive duration");
+        switch (seg.type)
+        {
+        case shape::constant:
+            positive |= seg.p[0] > 0;
+            break;
+        case shape::ramp:
+            positive |= seg.p[0] > 0 || seg.p[1] > 0;
+            break;
+        case shape::steps:
+            if (seg.p[2] < 1 || seg.p[2] != std::floor(seg.p[2]))
+                throw std::invalid_argument("profile segment '" + item + "' must have a positive whole number of steps");
+            positive |= seg.p[0] > 0 || seg.p[1] > 0;
+            break;
+        case shape::burst:
+            if (seg.p[2] <= 0 || seg.p[3] < 0 || seg.p[3] > 1)
+                throw std::invalid_argument("profile segment '" + item + "' must have a positive period and a duty cycle between 0 and 1");
+            positive |= seg.p[0] > 0 || (seg.p[1] > 0 && seg.p[3] > 0);
+            break;
+        case shape::sine:
+            if (seg.p[2] <= 0)
+                throw std::invalid_argument("profile segment '" + item + "' must have a positive period");
+            positive |= seg.p[0] + std::abs(seg.p[1]) > 0;
+            break;
+        }
+        segments.push_back(seg);
+        period += seg.duration;
+    }
+    if (segments.empty())
+        throw std::invalid_argument("profile is empty");
+    if (!positive)
+        throw std::invalid_argument("profile never has a positive rate");
+}
+
+double rate_profile::rate_at(const segment &seg, double u)
+{
+    double r = 0;
+    switch (seg.type)
+    {
+    case shape::constant:
+        r = seg.p[0];
+        break;
+    case shape::ramp:
+        r = seg.p[0] + (seg.p[1] - seg.p[0]) * (u / seg.duration);
+        break;
+    case shape::steps:
+        {
+            double n = seg.p[2];
+            if (n == 1)
+                r = seg.p[0];
+            else
+            {
+                double step = std::min(std::floor(u / seg.duration * n), n - 1);
+                r = seg.p[0] + (seg.p[1] - seg.p[0]) * (step / (n - 1));
+            }
+        }
+        break;
+    case shape::burst:
+        r = std::fmod(u, seg.p[2]) < seg.p[3] * seg.p[2] ? seg.p[1] : seg.p[0];
+        break;
+    case shape::sine:
+        r = seg.p[0] + seg.p[1] * std::sin(2 * M_PI * u / seg.p[2]);
+        break;
+    }
+    return std::max(r, 0.0);
+}
+
+double rate_profile::next_change(const segment &seg, double u)
+{
+    double end = seg.duration;
+    switch (seg.type)
+    {
+    case shape::constant:
+        break;
+    case shape::ramp:
+    case shape::sine:
+        end = u + resolution;
+        break;
+    case shape::steps:
+        {
+            double width = seg.duration / seg.p[2];
+            end = (std::floor(u / width) + 1) * width;
+        }
+        break;
+    case shape::burst:
+        {
+            // Computed as in rate_at, so that the two agree about the phase
+            double phase = std::fmod(u, seg.p[2]);
+            double on = seg.p[3] * seg.p[2];
+            end = u + (phase < on ? on - phase : seg.p[2] - phase);
+        }
+        break;
+    }
+    // Guard against rounding leaving no progress
+    if (!(end > u))
+        end = std::nextafter(u, HUGE_VAL);
+    return std::min(end, seg.duration);
+}
+
+void rate_profile::reset()
+{
+    cur = 0;
+    cur_start = 0;
+}
+
+void rate_profile::seek(double t)
+{
+    if (cur == 0 && t - cur_start >= period)
+        cur_start += std::floor((t - cur_start) / period) * period;
+    while (t >= cur_start + segments[cur].duration)
+    {
+        cur_start += segments[cur].duration;
+        cur++;
+        if (cur == segments.size())
+            cur = 0;
+    }
+}
+
+double rate_profile::rate(double t)
+{
+    seek(t);
+    return rate_at(segments[cur], t - cur_start);
+}
+
+double rate_profile::advance(double t, double work)
+{
+    while (work > 0)
+    {
+        seek(t);
+        const segment &seg = segments[cur];
+        double u = t - cur_start;
+        double end = next_change(seg, u);
+        double r = rate_at(seg, u);
+        if (r * (end - u) >= work)
+            return t + work / r;
+        work -= r * (end - u);
+        // Rounding might otherwise leave t just short of a boundary forever
+        t = std::max(cur_start + end, std::nextafter(t, HUGE_VAL));
+    }
+    return t;
+}
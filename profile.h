@@ -0,0 +1,92 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_PROFILE_H
+#define UDPREPLAY_PROFILE_H
+
+#include <config.h>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+/* A rate that varies over time, as a multiple of --pps or --mbps. It is
+ * made of segments, which are separated by semicolons or newlines, and
+ * repeats once the last segment ends. Each segment is a shape, a duration
+ * in seconds and the shape's parameters:
+ *
+ * - const D R: rate R
+ * - ramp D R0 R1: linear from R0 to R1
+ * - steps D R0 R1 N: N equal steps from R0 to R1
+ * - burst D LOW HIGH PERIOD DUTY: HIGH for the first DUTY fraction of each
+ *   PERIOD seconds, otherwise LOW
+ * - sine D MEAN AMPLITUDE PERIOD
+ *
+ * Text from a '#' to the end of a line is ignored. Negative rates are
+ * treated as zero.
+ *
+ * Send times are found by integrating the rate from the previous send
+ * time, so nothing is precomputed per packet, and the position in the
+ * profile is tracked so that it is evaluated incrementally.
+ */
+class rate_profile
+{
+private:
+    enum class shape
+    {
+        constant, ramp, steps, burst, sine
+    };
+
+    struct segment
+    {
+        shape type;
+        double duration;
+        double p[4];
+    };
+
+    /// Step for integrating shapes that change continuously (seconds)
+    static constexpr double resolution = 1e-4;
+
+    std::vector<segment> segments;
+    double period = 0;       // total duration of the segments
+
+    // Position of the last query
+    std::size_t cur = 0;
+    double cur_start = 0;    // time at which segment cur started
+
+    /// Rate at time @a u into segment @a seg
+    static double rate_at(const segment &seg, double u);
+    /// Time into @a seg, after @a u, until which rate_at(seg, u) may be used
+    static double next_change(const segment &seg, double u);
+    /// Move the position to the segment containing @a t
+    void seek(double t);
+
+public:
+    /// Parse @a spec, throwing std::invalid_argument if it is malformed
+    explicit rate_profile(const std::string &spec);
+
+    /// Return to the start of the profile
+    void reset();
+    /// Rate at time @a t (seconds from the start)
+    double rate(double t);
+    /**
+     * Time at which an amount @a work of sending, in seconds at a rate of
+     * 1, is complete if started at time @a t. Times must not decrease
+     * between calls (without a reset).
+     */
+    double advance(double t, double work);
+};
+
+#endif // UDPREPLAY_PROFILE_H
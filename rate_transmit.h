@@ -2,44 +2,289 @@
 #define UDPREPLAY_RATE_TRANSMIT_H
 
 #include <config.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include <boost/asio.hpp>
 #include "common.h"
+#include "pacer.h"
+#include "profile.h"
 
-/// Wraps another transmitter to rate-limit it
+/* Wraps another transmitter to rate-limit it. Each range of packets passed
+ * in is split into sub-batches of packets whose send times fall within the
+ * pacing quantum of the first, and each sub-batch is sent at the time of its
+ * first packet.
+ *
+ * Send times normally come from the packet timestamps. With --profile, they
+ * are instead found as the packets are sent, by integrating the profile's
+ * rate from the start of transmission.
+ *
+ * A sub-batch that is more than the late threshold behind its send time is
+ * handled according to --late-policy:
+ * - burst: send it immediately, and catch up as fast as possible;
+ * - shift: move the rest of the schedule back by the delay;
+ * - drop: skip it;
+ * - cap: as for shift, but then catch up at --catch-up-rate times the
+ *   nominal rate, by shrinking the shift as the schedule advances.
+ */
 template<typename Transmit>
 class rate_transmit
 {
 private:
-    boost::asio::io_service &io_service;
     Transmit transmit;
+    pacer timer;
     bool limited = false;
+    duration quantum;
+    duration paced{};      // time spent waiting for send times
+    duration max_late{};   // worst timing errors, at the time of the send call
+    duration max_early{};
+    /* How far ahead of its send time a batch is handed over. With --txtime
+     * the qdisc holds each packet until its launch time, so the batch only
+     * needs to reach it in time; it is still split so that no packet is
+     * handed over more than lead + quantum ahead of its launch time.
+     */
+    duration lead{};
+
+    enum class late_policy
+    {
+        burst, shift, drop, cap
+    };
+    late_policy policy = late_policy::burst;
+    duration late_threshold;
+    double catch_up_rate;
+    duration shift{};             // delay applied to the whole schedule
+    time_point prev_nominal;      // unshifted send time of the previous sub-batch
+    std::uint64_t late_packets = 0;
+    std::uint64_t dropped_packets = 0;
+    std::uint64_t dropped_bytes = 0;
+    std::uint64_t caught_up_packets = 0;
+    duration total_shift{};
+
+    /* Timing of the packets sent, relative to their unshifted send times.
+     * Every packet in a sub-batch is taken to be sent when the send call is
+     * made.
+     */
+    histogram lateness;
+    histogram gap_error;
+    std::vector<duration> offsets;    // of the packets in the current sub-batch
+    time_point prev_sent;             // when the previous packet was sent
+    time_point prev_scheduled;        // and its send time
+    bool have_prev = false;
+
+    live_counters live;
+
+    std::unique_ptr<rate_profile> profile;     // null unless --profile
+    double per_packet = 0;   // seconds per packet at a rate of 1 in the profile
+    double per_byte = 0;     // seconds per byte at a rate of 1 in the profile
+    time_point profile_start;
+    double profile_time = 0; // send time of the next packet, relative to profile_start
+
+    /**
+     * Send time of packet @a idx, relative to the start. With a profile this
+     * also moves on to the following packet, so it must be called exactly
+     * once for each packet, in the order they are sent.
+     */
+    duration next_offset(std::size_t idx)
+    {
+        if (!profile)
+            return transmit.get_collector().packet_timestamp(idx);
+        double t = profile_time;
+        std::size_t size = transmit.get_collector().packet_size(idx);
+        profile_time = profile->advance(t, per_packet + per_byte * size);
+        return std::chrono::duration_cast<duration>(std::chrono::duration<double>(t));
+    }
+
+    /// Update the live counters after sending packets [@a first, @a last)
+    void count_sent(std::size_t first, std::size_t last)
+    {
+        std::uint64_t bytes = 0;
+        for (std::size_t i = first; i < last; i++)
+            bytes += transmit.get_collector().packet_size(i);
+        live.add_sent(last - first, bytes);
+        live.set_icmp_errors(transmit.get_stats().icmp_errors);
+    }
+
+    /// Add the packets of the current sub-batch, sent at @a now, to the histograms
+    void record_timing(time_point now, time_point start)
+    {
+        time_point scheduled = start + offsets[0];
+        if (have_prev)
+        {
+            duration error = (now - prev_sent) - (scheduled - prev_scheduled);
+            gap_error.add(error < duration::zero() ? -error : error);
+        }
+        lateness.add(now - scheduled);
+        for (std::size_t i = 1; i < offsets.size(); i++)
+        {
+            // Sent together, so the gap error is the scheduled gap
+            gap_error.add(offsets[i] - offsets[i - 1]);
+            lateness.add(now - (start + offsets[i]));
+        }
+        prev_sent = now;
+        prev_scheduled = start + offsets.back();
+        have_prev = true;
+    }
 
 public:
     static constexpr int batch_size = Transmit::batch_size;
     typedef typename Transmit::collector_type collector_type;
 
     explicit rate_transmit(const options &opts, boost::asio::io_service &io_service)
-        : io_service(io_service), transmit(opts, io_service)
+        : transmit(opts, io_service), timer(opts),
+        quantum(std::chrono::duration_cast<duration>(
+            std::chrono::duration<double, std::micro>(opts.pacing_quantum))),
+        late_threshold(std::chrono::duration_cast<duration>(
+            std::chrono::duration<double, std::micro>(opts.late_threshold))),
+        catch_up_rate(opts.catch_up_rate)
     {
+        if (opts.late_policy == "shift")
+            policy = late_policy::shift;
+        else if (opts.late_policy == "drop")
+            policy = late_policy::drop;
+        else if (opts.late_policy == "cap")
+            policy = late_policy::cap;
         limited = opts.pps != 0 || opts.mbps != 0 || opts.use_timestamps;
+        if (opts.txtime)
+            lead = std::chrono::milliseconds(1);
+        if (!opts.profile.empty())
+        {
+            profile.reset(new rate_profile(opts.profile));
+            // Each thread sends its share of the packets at its share of the rate
+            if (opts.pps != 0)
+                per_packet = opts.threads / opts.pps;
+            if (opts.mbps != 0)
+                per_byte = opts.threads * 8.0 / (opts.mbps * 1e6);
+        }
     }
 
     void send_packets(std::size_t first, std::size_t last,
                       time_point start)
     {
-        if (limited)
+        if (!limited)
+        {
+            transmit.send_packets(first, last, start);
+            count_sent(first, last);
+            return;
+        }
+        if (profile && start != profile_start)
         {
-            auto &collector = transmit.get_collector();
-            time_point next_send = start + collector.packet_timestamp(first);
-            boost::asio::basic_waitable_timer<time_point::clock> timer(io_service);
-            timer.expires_at(next_send);
-            timer.wait();
+            // A new run
+            profile->reset();
+            profile_start = start;
+            profile_time = 0;
+        }
+        duration offset = next_offset(first);
+        while (first < last)
+        {
+            std::size_t end = first + 1;
+            duration last_offset = offset;    // of packet end - 1
+            duration next = offset;           // of packet end
+            offsets.clear();
+            offsets.push_back(offset);
+            duration horizon = lead + quantum;
+            while (end < last)
+            {
+                next = next_offset(end);
+                if (next - offset > horizon)
+                    break;
+                offsets.push_back(next);
+                last_offset = next;
+                end++;
+            }
+            time_point nominal = start + offset;
+            if (shift != duration::zero())
+            {
+                if (policy == late_policy::cap)
+                {
+                    duration step = nominal - prev_nominal;
+                    shift -= std::min(shift, std::chrono::duration_cast<duration>(
+                        step * (1.0 - 1.0 / catch_up_rate)));
+                    if (shift != duration::zero())
+                        caught_up_packets += end - first;
+                }
+                // If the original schedule is in the future, a new run has started
+                if (time_point::clock::now() <= nominal)
+                    shift = duration::zero();
+            }
+            prev_nominal = nominal;
+
+            time_point deadline = nominal + shift;
+            duration waited;
+            time_point now = timer.wait_until(deadline - lead, waited);
+            paced += waited;
+            if (interrupted())
+                break;
+            bool send = true;
+            if (lead == duration::zero())
+            {
+                /* The first packet is the latest relative to its send time,
+                 * and the last the earliest.
+                 */
+                duration late = now - deadline;
+                if (late > late_threshold)
+                {
+                    switch (policy)
+                    {
+                    case late_policy::burst:
+                        late_packets += end - first;
+                        live.add_late(end - first);
+                        break;
+                    case late_policy::drop:
+                        send = false;
+                        dropped_packets += end - first;
+                        live.add_dropped(end - first);
+                        for (std::size_t i = first; i < end; i++)
+                            dropped_bytes += transmit.get_collector().packet_size(i);
+                        break;
+                    case late_policy::shift:
+                    case late_policy::cap:
+                        late_packets += end - first;
+                        live.add_late(end - first);
+                        shift += late;
+                        total_shift += late;
+                        late = duration::zero();
+                        break;
+                    }
+                }
+                if (send)
+                {
+                    duration early = last_offset - offset - late;
+                    max_late = std::max(max_late, late);
+                    max_early = std::max(max_early, early);
+                    record_timing(now, start);
+                }
+            }
+            if (send)
+            {
+                transmit.send_packets(first, end, start);
+                count_sent(first, end);
+            }
+            first = end;
+            offset = next;
         }
-        transmit.send_packets(first, last, start);
     }
 
     collector_type &get_collector() { return transmit.get_collector(); }
 
+    /// Totals so far, which may be read from any thread
+    live_totals get_live() const { return live.load(); }
+
+    transmit_stats get_stats() const
+    {
+        transmit_stats out = transmit.get_stats();
+        out.paced += paced;
+        out.max_late = max_late;
+        out.max_early = max_early;
+        out.late_packets += late_packets;
+        out.dropped_packets += dropped_packets;
+        out.dropped_bytes += dropped_bytes;
+        out.caught_up_packets += caught_up_packets;
+        out.shifted += total_shift;
+        out.lateness += lateness;
+        out.gap_error += gap_error;
+        return out;
+    }
+
     void flush()
     {
         transmit.flush();
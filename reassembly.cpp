@@ -0,0 +1,167 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <cstring>
+#include <cassert>
+#include "reassembly.h"
+
+datagram_pool::datagram_pool(std::size_t max_buffers) : max_buffers(max_buffers)
+{
+}
+
+std::uint8_t *datagram_pool::allocate()
+{
+    if (free_buffers.empty())
+    {
+        if (allocated >= max_buffers)
+            return nullptr;
+        std::size_t n = std::min(slab_buffers, max_buffers - allocated);
+        slabs.emplace_back(new std::uint8_t[n * buffer_size]);
+        for (std::size_t i = 0; i < n; i++)
+            free_buffers.push_back(slabs.back().get() + (n - 1 - i) * buffer_size);
+        allocated += n;
+    }
+    std::uint8_t *buffer = free_buffers.back();
+    free_buffers.pop_back();
+    return buffer;
+}
+
+void datagram_pool::release(std::uint8_t *buffer)
+{
+    free_buffers.push_back(buffer);
+}
+
+constexpr std::size_t datagram_pool::buffer_size;
+constexpr std::size_t datagram_pool::slab_buffers;
+
+
+reassembler::reassembler(std::size_t max_entries, time_type timeout)
+    : pool(max_entries), max_entries(max_entries), timeout(timeout)
+{
+    assert(max_entries > 0);
+}
+
+void reassembler::remove(std::list<entry>::iterator it)
+{
+    if (it->buffer)
+        pool.release(it->buffer);
+    lookup.erase(it->key);
+    entries.erase(it);
+}
+
+void reassembler::expire(time_type now)
+{
+    while (!entries.empty() && now - entries.front().first_seen > timeout)
+    {
+        if (entries.front().bad)
+            stats.dropped++;
+        else
+            stats.evicted++;
+        remove(entries.begin());
+    }
+}
+
+const std::uint8_t *reassembler::add_fragment(
+    const fragment_key &key, time_type now,
+    std::size_t offset, bool more,
+    const std::uint8_t *data, std::size_t len,
+    std::size_t &out_len)
+{
+    if (completed)
+    {
+        pool.release(completed);
+        completed = nullptr;
+    }
+    expire(now);
+
+    auto pos = lookup.find(key);
+    if (pos == lookup.end())
+    {
+        if (entries.size() >= max_entries)
+        {
+            if (entries.front().bad)
+                stats.dropped++;
+            else
+                stats.evicted++;
+            remove(entries.begin());
+        }
+        entries.emplace_back();
+        entry &e = entries.back();
+        e.key = key;
+        e.first_seen = now;
+        e.buffer = pool.allocate();
+        assert(e.buffer);
+        pos = lookup.emplace(key, std::prev(entries.end())).first;
+    }
+    entry &e = *pos->second;
+    if (e.bad)
+        return nullptr;
+
+    std::size_t end = offset + len;
+    std::size_t first_unit = offset / 8;
+    std::size_t end_unit = (end + 7) / 8;
+    bool valid = end <= datagram_pool::buffer_size - 1
+        && (more ? len % 8 == 0 : e.total_len == 0)
+        && (e.total_len == 0 || end <= e.total_len);
+    for (std::size_t i = first_unit; valid && i < end_unit; i++)
+        if (e.coverage[i])
+            valid = false;    // overlapping fragment
+    if (valid && !more)
+    {
+        // Nothing may have been received beyond the end of the datagram
+        for (std::size_t i = end_unit; valid && i < units; i++)
+            if (e.coverage[i])
+                valid = false;
+    }
+    if (!valid)
+    {
+        e.bad = true;
+        pool.release(e.buffer);
+        e.buffer = nullptr;
+        return nullptr;
+    }
+
+    std::memcpy(e.buffer + offset, data, len);
+    for (std::size_t i = first_unit; i < end_unit; i++)
+        e.coverage[i] = true;
+    if (!more)
+        e.total_len = end;
+    if (e.total_len == 0 || e.coverage.count() != (e.total_len + 7) / 8)
+        return nullptr;
+
+    // Complete. Hand the buffer to the caller until the next call.
+    stats.reassembled++;
+    out_len = e.total_len;
+    completed = e.buffer;
+    e.buffer = nullptr;
+    remove(pos->second);
+    return completed;
+}
+
+void reassembler::flush()
+{
+    while (!entries.empty())
+    {
+        if (entries.front().bad)
+            stats.dropped++;
+        else
+            stats.evicted++;
+        remove(entries.begin());
+    }
+}
+
+constexpr std::size_t reassembler::units;
@@ -0,0 +1,148 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_REASSEMBLY_H
+#define UDPREPLAY_REASSEMBLY_H
+
+#include <config.h>
+#include <memory>
+#include <vector>
+#include <list>
+#include <bitset>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+
+/// Identifies the datagram that an IPv4 fragment belongs to
+struct fragment_key
+{
+    std::uint32_t src;   // in big endian
+    std::uint32_t dst;   // in big endian
+    std::uint16_t id;    // in big endian
+
+    bool operator==(const fragment_key &other) const
+    {
+        return src == other.src && dst == other.dst && id == other.id;
+    }
+};
+
+struct fragment_key_hash
+{
+    std::size_t operator()(const fragment_key &key) const
+    {
+        std::uint64_t h = (std::uint64_t(key.src) << 32) ^ key.dst;
+        h ^= std::uint64_t(key.id) << 16;
+        return std::hash<std::uint64_t>()(h * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+/* Fixed-size buffers large enough for any IP datagram, allocated in slabs
+ * and recycled through a free list, with an upper bound on the number of
+ * buffers.
+ */
+class datagram_pool : public boost::noncopyable
+{
+public:
+    static constexpr std::size_t buffer_size = 65536;
+    static constexpr std::size_t slab_buffers = 64;
+
+private:
+    std::vector<std::unique_ptr<std::uint8_t[]>> slabs;
+    std::vector<std::uint8_t *> free_buffers;
+    std::size_t max_buffers;
+    std::size_t allocated = 0;
+
+public:
+    explicit datagram_pool(std::size_t max_buffers);
+
+    /// Returns nullptr if all buffers are in use
+    std::uint8_t *allocate();
+    void release(std::uint8_t *buffer);
+};
+
+/* Reassembles fragmented IPv4 datagrams. At most @a max_entries datagrams
+ * are in progress at once; if the table is full, or a datagram has not been
+ * completed within @a timeout (in capture time), the oldest is evicted.
+ * Coverage is tracked in units of 8 bytes, and a datagram with overlapping
+ * fragments or an impossible length is dropped.
+ */
+class reassembler : public boost::noncopyable
+{
+public:
+    typedef std::chrono::nanoseconds time_type;
+
+    struct counters
+    {
+        std::uint64_t reassembled = 0;
+        std::uint64_t evicted = 0;
+        std::uint64_t dropped = 0;
+    };
+
+private:
+    static constexpr std::size_t units = datagram_pool::buffer_size / 8;
+
+    struct entry
+    {
+        fragment_key key;
+        time_type first_seen;
+        std::uint8_t *buffer;
+        std::bitset<units> coverage;
+        std::size_t total_len = 0;   // 0 until the last fragment is seen
+        bool bad = false;            // overlapping or oversized fragments seen
+    };
+
+    datagram_pool pool;
+    std::list<entry> entries;     // oldest first
+    std::unordered_map<fragment_key, std::list<entry>::iterator, fragment_key_hash> lookup;
+    std::size_t max_entries;
+    time_type timeout;
+    std::uint8_t *completed = nullptr;    // buffer to release on the next call
+    counters stats;
+
+    void remove(std::list<entry>::iterator it);
+    void expire(time_type now);
+
+public:
+    reassembler(std::size_t max_entries, time_type timeout);
+
+    /**
+     * Add a fragment of a datagram.
+     *
+     * @param key       Datagram identifier
+     * @param now       Capture time of the fragment
+     * @param offset    Byte offset of the fragment within the datagram
+     * @param more      Whether the More Fragments flag is set
+     * @param data, len IP payload of the fragment
+     * @param[out] out_len  Length of the completed datagram
+     *
+     * @returns The completed IP payload, or nullptr if the datagram is not yet
+     * complete. It remains valid until the next call.
+     */
+    const std::uint8_t *add_fragment(
+        const fragment_key &key, time_type now,
+        std::size_t offset, bool more,
+        const std::uint8_t *data, std::size_t len,
+        std::size_t &out_len);
+
+    /// Evict all incomplete datagrams, e.g. at the end of the capture
+    void flush();
+
+    const counters &get_counters() const { return stats; }
+};
+
+#endif // UDPREPLAY_REASSEMBLY_H
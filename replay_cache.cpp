@@ -0,0 +1,257 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <cerrno>
+#include <chrono>
+#include <system_error>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "replay_cache.h"
+
+static const char cache_magic[8] = {'U', 'D', 'P', 'R', 'C', 'A', 'C', 'H'};
+static constexpr std::uint32_t cache_version = 2;
+static constexpr std::uint32_t payload_alignment = 64;
+
+struct file_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t alignment;
+    std::uint64_t sources_hash;
+    std::uint64_t params_hash;
+    std::uint64_t num_packets;
+    std::uint64_t payload_bytes;
+    std::uint64_t index_offset;
+};
+
+struct index_entry
+{
+    std::uint64_t offset;
+    std::int64_t timestamp_ns;
+    std::uint32_t len;
+    std::uint32_t dst_host;    // in big endian
+    std::uint16_t dst_port;    // in big endian
+    std::uint8_t pad[6];
+};
+
+static std::uint64_t round_up(std::uint64_t value)
+{
+    return (value + payload_alignment - 1) / payload_alignment * payload_alignment;
+}
+
+// 64-bit FNV-1a, which unlike std::hash is stable between runs
+static std::uint64_t hash_bytes(std::uint64_t h, const void *data, std::size_t len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    for (std::size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static constexpr std::uint64_t hash_init = 0xcbf29ce484222325ULL;
+
+cache_key::cache_key(const std::vector<std::string> &sources, const std::string &params)
+{
+    sources_hash = hash_init;
+    for (const std::string &source : sources)
+    {
+        struct stat st;
+        if (stat(source.c_str(), &st) < 0)
+            throw std::system_error(errno, std::system_category(), "could not stat " + source);
+        std::uint64_t fields[4] =
+        {
+            std::uint64_t(st.st_size),
+            std::uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+            std::uint64_t(st.st_dev),
+            std::uint64_t(st.st_ino)
+        };
+        sources_hash = hash_bytes(sources_hash, fields, sizeof(fields));
+    }
+    params_hash = hash_bytes(hash_init, params.data(), params.size());
+}
+
+bool cache_key::operator==(const cache_key &other) const
+{
+    return sources_hash == other.sources_hash && params_hash == other.params_hash;
+}
+
+
+cache_writer::cache_writer(const std::string &filename, const cache_key &key)
+    : filename(filename), key(key)
+{
+    /* Each writer needs its own temporary file, since other runs may be
+     * building the same cache at the same time. It is in the same directory
+     * as the cache so that the rename is atomic.
+     */
+    std::vector<char> tmp_name(filename.begin(), filename.end());
+    const char suffix[] = ".tmp.XXXXXX";
+    tmp_name.insert(tmp_name.end(), suffix, suffix + sizeof(suffix));
+    int fd = mkstemp(tmp_name.data());
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "could not create " + filename + ".tmp");
+    tmp_filename = tmp_name.data();
+    // mkstemp creates the file readable only by its owner
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+    close(fd);
+
+    out.exceptions(std::ios::failbit | std::ios::badbit);
+    try
+    {
+        out.open(tmp_filename, std::ios::binary | std::ios::trunc);
+    }
+    catch (std::ios::failure &e)
+    {
+        throw std::runtime_error("could not create " + tmp_filename);
+    }
+    // Header is written by commit
+    offset = round_up(sizeof(file_header));
+    out.seekp(offset);
+}
+
+cache_writer::~cache_writer()
+{
+    if (!committed)
+    {
+        out.exceptions(std::ios::goodbit);
+        out.close();
+        std::remove(tmp_filename.c_str());
+    }
+}
+
+void cache_writer::add_packet(const packet &pkt)
+{
+    static const char zeros[payload_alignment] = {};
+
+    index_entry entry = {};
+    entry.offset = offset;
+    entry.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(pkt.timestamp).count();
+    entry.len = pkt.len;
+    entry.dst_host = pkt.dst_host;
+    entry.dst_port = pkt.dst_port;
+    const std::uint8_t *raw = (const std::uint8_t *) &entry;
+    index.insert(index.end(), raw, raw + sizeof(entry));
+
+    out.write((const char *) pkt.data, pkt.len);
+    std::uint64_t next = round_up(offset + pkt.len);
+    out.write(zeros, next - (offset + pkt.len));
+    offset = next;
+    num_packets++;
+    payload_bytes += pkt.len;
+}
+
+void cache_writer::commit()
+{
+    file_header header = {};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.alignment = payload_alignment;
+    header.sources_hash = key.sources_hash;
+    header.params_hash = key.params_hash;
+    header.num_packets = num_packets;
+    header.payload_bytes = payload_bytes;
+    header.index_offset = offset;
+
+    out.write((const char *) index.data(), index.size());
+    out.seekp(0);
+    out.write((const char *) &header, sizeof(header));
+    out.close();
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+        throw std::system_error(errno, std::system_category(), "could not rename " + tmp_filename);
+    committed = true;
+}
+
+
+std::unique_ptr<mapped_cache> mapped_cache::open(const std::string &filename, const cache_key &key)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return nullptr;
+        throw std::system_error(errno, std::system_category(), "could not open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || std::size_t(st.st_size) < sizeof(file_header))
+    {
+        close(fd);
+        return nullptr;
+    }
+    std::size_t length = st.st_size;
+    void *ptr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    std::unique_ptr<mapped_cache> cache(new mapped_cache);
+    cache->data.reset((const std::uint8_t *) ptr,
+                      [length](const std::uint8_t *p) { munmap((void *) p, length); });
+    cache->length = length;
+
+    file_header header;
+    std::memcpy(&header, ptr, sizeof(header));
+    cache_key stored;
+    stored.sources_hash = header.sources_hash;
+    stored.params_hash = header.params_hash;
+    if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0
+        || header.version != cache_version
+        || header.alignment != payload_alignment
+        || !(stored == key)
+        || header.index_offset > length
+        || (length - header.index_offset) % sizeof(index_entry) != 0
+        || (length - header.index_offset) / sizeof(index_entry) != header.num_packets)
+        return nullptr;
+
+    cache->index = cache->data.get() + header.index_offset;
+    /* Check every entry once, so that get_packet cannot hand out pointers
+     * beyond the payloads even if the file is truncated or corrupt.
+     */
+    for (std::uint64_t i = 0; i < header.num_packets; i++)
+    {
+        index_entry entry;
+        std::memcpy(&entry, cache->index + i * sizeof(index_entry), sizeof(entry));
+        if (entry.offset < sizeof(file_header)
+            || entry.offset > header.index_offset
+            || entry.len > header.index_offset - entry.offset)
+            return nullptr;
+    }
+
+    cache->n_packets = header.num_packets;
+    cache->payload_bytes = header.payload_bytes;
+    return cache;
+}
+
+packet mapped_cache::get_packet(std::size_t idx) const
+{
+    index_entry entry;
+    std::memcpy(&entry, index + idx * sizeof(index_entry), sizeof(entry));
+    duration timestamp = std::chrono::duration_cast<duration>(
+        std::chrono::nanoseconds(entry.timestamp_ns));
+    return {data.get() + entry.offset, entry.len, timestamp,
+            entry.dst_host, entry.dst_port, true};
+}
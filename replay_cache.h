@@ -0,0 +1,104 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_REPLAY_CACHE_H
+#define UDPREPLAY_REPLAY_CACHE_H
+
+#include <config.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include "common.h"
+
+/* A replay cache holds the packets of a capture exactly as they are added to
+ * the collector (timestamps computed and destinations resolved), so that
+ * later runs can map it and start transmitting without parsing the capture.
+ *
+ * Layout: a header, the payloads (each aligned to payload_alignment), and
+ * finally an index with one entry per packet. Values are stored in native
+ * byte order, since the cache is not intended to be portable.
+ */
+
+/// Identifies the source captures and the options used to build a cache
+struct cache_key
+{
+    std::uint64_t sources_hash = 0;   // hash of size, mtime and inode of each source
+    std::uint64_t params_hash = 0;
+
+    /**
+     * @param sources  Filenames of the captures
+     * @param params   Description of all options affecting the loaded packets
+     */
+    cache_key(const std::vector<std::string> &sources, const std::string &params);
+    cache_key() = default;
+
+    bool operator==(const cache_key &other) const;
+};
+
+class cache_writer : public boost::noncopyable
+{
+private:
+    std::string filename;
+    std::string tmp_filename;
+    std::ofstream out;
+    cache_key key;
+    std::vector<std::uint8_t> index;
+    std::uint64_t offset;
+    std::uint64_t num_packets = 0;
+    std::uint64_t payload_bytes = 0;
+    bool committed = false;
+
+public:
+    /// Starts writing a cache to a temporary file next to @a filename
+    cache_writer(const std::string &filename, const cache_key &key);
+    ~cache_writer();
+
+    void add_packet(const packet &pkt);
+    /// Finish writing and atomically replace @a filename
+    void commit();
+};
+
+class mapped_cache : public boost::noncopyable
+{
+private:
+    std::shared_ptr<const std::uint8_t> data;
+    const std::uint8_t *index;
+    std::size_t length;
+    std::size_t n_packets;
+    std::size_t payload_bytes;
+
+    mapped_cache() = default;
+
+public:
+    /**
+     * Map an existing cache. Returns a null pointer if the cache does not
+     * exist, is invalid, or was built from a different capture or options.
+     */
+    static std::unique_ptr<mapped_cache> open(const std::string &filename, const cache_key &key);
+
+    std::size_t num_packets() const { return n_packets; }
+    std::size_t bytes() const { return payload_bytes; }
+    /// Returns a stable packet that points into the mapping
+    packet get_packet(std::size_t idx) const;
+    /// Handle that keeps the mapping alive after this object is destroyed
+    std::shared_ptr<const void> owner() const { return data; }
+};
+
+#endif // UDPREPLAY_REPLAY_CACHE_H
@@ -18,59 +18,284 @@
 
 #if HAVE_SENDMMSG
 
+#include <unordered_map>
+#include <algorithm>
+#include <new>
+#include <cstring>
 #include <system_error>
 #include <stdexcept>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
+#if HAVE_TXTIME
+# include <linux/net_tstamp.h>
+#endif
 #include <boost/asio.hpp>
 #include "sendmmsg_transmit.h"
 
 using boost::asio::ip::udp;
 
 sendmmsg_transmit::sendmmsg_transmit(const options &opts, boost::asio::io_service &io_service)
-    : socket(io_service)
+    : socket(io_service), use_zerocopy(opts.zerocopy), sockets(opts, io_service),
+    txtime(opts.txtime), txtime_clock(opts.txtime_clock == "tai" ? CLOCK_TAI : CLOCK_MONOTONIC),
+    use_timestamps(opts.tx_timestamps)
 {
     socket.open(udp::v4());
     set_buffer_size(socket, opts.buffer_size);
     set_ttl(socket, opts.ttl);
+    socket.non_blocking(true);
     fd = socket.native_handle();
+    if (opts.zerocopy)
+        zerocopy.reset(new zerocopy_tracker(fd, stats));
+    if (txtime)
+        enable_txtime(fd);
+    if (use_timestamps)
+        timestamps.reset(new tx_timestamp_tracker(fd, stats));
 }
 
-void sendmmsg_transmit::send_packets(std::size_t first, std::size_t last,
-                                     time_point start)
+sendmmsg_transmit::~sendmmsg_transmit()
+{
+    if (zerocopy)
+    {
+        try
+        {
+            flush();
+        }
+        catch (std::exception &e)
+        {
+            // Only happens if sending has already failed
+        }
+    }
+}
+
+void sendmmsg_transmit::enable_txtime(int fd)
+{
+#if HAVE_TXTIME
+    sock_txtime config = {};
+    config.clockid = txtime_clock;
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(SO_TXTIME) failed");
+#else
+    throw std::runtime_error("SO_TXTIME is not supported on this system");
+#endif
+}
+
+void sendmmsg_transmit::set_txtimes(std::size_t first, std::size_t last, time_point start)
 {
-    (void) start; // unused;
-    mmsghdr msg_vec[batch_size];
-    iovec msg_iov[batch_size];
-    sockaddr_in addr[batch_size];
-
-    assert(last - first <= batch_size);
-    int next = 0;
-    std::memset(&msg_vec, 0, sizeof(msg_vec));
-    for (std::size_t i = first; i != last; ++i)
+#if HAVE_TXTIME
+    // Convert from our clock to the one the qdisc uses
+    timespec now;
+    clock_gettime(txtime_clock, &now);
+    std::chrono::nanoseconds offset =
+        std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec)
+        - time_point::clock::now().time_since_epoch();
+    for (std::size_t i = first; i < last; i++)
+    {
+        time_point when = start + collector.packet_timestamp(i);
+        std::uint64_t ns = (std::chrono::duration_cast<std::chrono::nanoseconds>(
+            when.time_since_epoch()) + offset).count();
+        std::memcpy(CMSG_DATA(&controls[i].align), &ns, sizeof(ns));
+    }
+#endif
+}
+
+void sendmmsg_transmit::prepare()
+{
+    std::size_t n = collector.num_packets();
+    if (n > messages_capacity)
+    {
+        void *ptr;
+        if (posix_memalign(&ptr, 64, n * sizeof(mmsghdr)) != 0)
+            throw std::bad_alloc();
+        messages.reset((mmsghdr *) ptr);
+        messages_capacity = n;
+    }
+    iovecs.resize(n);
+    addresses.clear();
+    if (!sockets.assign(collector, packet_socket))
+        packet_socket.clear();
+    if (use_zerocopy)
+        while (connected_zerocopy.size() < sockets.size())
+            connected_zerocopy.emplace_back(new zerocopy_tracker(
+                sockets[connected_zerocopy.size()].native_handle(), stats));
+    if (use_timestamps)
+        while (connected_timestamps.size() < sockets.size())
+            connected_timestamps.emplace_back(new tx_timestamp_tracker(
+                sockets[connected_timestamps.size()].native_handle(), stats));
+    if (txtime)
+        for (; txtime_sockets < sockets.size(); txtime_sockets++)
+            enable_txtime(sockets[txtime_sockets].native_handle());
+    std::unordered_map<std::uint64_t, std::size_t> address_index;
+    std::vector<std::size_t> packet_address(n);
+    for (std::size_t i = 0; i < n; i++)
     {
         packet pkt = collector.get_packet(i);
-        addr[next].sin_family = AF_INET;
-        addr[next].sin_addr.s_addr = pkt.dst_host;
-        addr[next].sin_port = pkt.dst_port;
-        msg_vec[next].msg_hdr.msg_name = (void *) &addr[next];
-        msg_vec[next].msg_hdr.msg_namelen = sizeof(addr[next]);
-        msg_vec[next].msg_hdr.msg_iov = &msg_iov[next];
-        msg_vec[next].msg_hdr.msg_iovlen = 1;
-        msg_iov[next].iov_base = const_cast<u_char *>(pkt.data);
-        msg_iov[next].iov_len = pkt.len;
-        next++;
+        iovecs[i].iov_base = const_cast<u_char *>(pkt.data);
+        iovecs[i].iov_len = pkt.len;
+        if (!packet_socket.empty())
+            continue;     // connected sockets need no addresses
+        std::uint64_t key = (std::uint64_t(pkt.dst_host) << 16) | pkt.dst_port;
+        auto pos = address_index.emplace(key, addresses.size());
+        if (pos.second)
+        {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = pkt.dst_host;
+            addr.sin_port = pkt.dst_port;
+            addresses.push_back(addr);
+        }
+        packet_address[i] = pos.first->second;
+    }
+    // Only now are the addresses at their final locations
+    std::memset(messages.get(), 0, n * sizeof(mmsghdr));
+    for (std::size_t i = 0; i < n; i++)
+    {
+        msghdr &hdr = messages[i].msg_hdr;
+        if (packet_socket.empty())
+        {
+            hdr.msg_name = (void *) &addresses[packet_address[i]];
+            hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        hdr.msg_iov = &iovecs[i];
+        hdr.msg_iovlen = 1;
+    }
+#if HAVE_TXTIME
+    if (txtime)
+    {
+        controls.resize(n);
+        for (std::size_t i = 0; i < n; i++)
+        {
+            msghdr &hdr = messages[i].msg_hdr;
+            hdr.msg_control = controls[i].buf;
+            hdr.msg_controllen = sizeof(controls[i].buf);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(std::uint64_t));
+        }
+    }
+#endif
+    prepared_version = collector.version();
+    prepared = true;
+}
+
+void sendmmsg_transmit::send_messages(int fd, zerocopy_tracker *zc, tx_timestamp_tracker *ts,
+                                      mmsghdr *msg_vec, const time_point *times, int n)
+{
+    int done = 0;
+    while (done < n)
+    {
+        int status = sendmmsg(fd, msg_vec + done, n - done, zc ? zerocopy_tracker::send_flags : 0);
+        if (status < 0)
+        {
+            int err = errno;
+            if (err == EAGAIN || err == EWOULDBLOCK)
+                wait_writable(fd, stats);
+            else if (is_icmp_error(err))
+                stats.icmp_errors++;    // reported for an earlier datagram; this one was not sent
+            else if (zc)
+                zc->handle_error(err);
+            else
+                throw std::system_error(err, std::system_category(), "sendmmsg failed");
+            stats.retries++;
+            continue;
+        }
+        if (zc)
+            zc->add_sent(status);
+        if (ts)
+            ts->add_sent(times + done, times + done + status);
+        done += status;
+        if (done < n)
+            stats.retries++;    // the socket buffer filled part-way
     }
-    int status = sendmmsg(fd, &msg_vec[0], next, 0);
-    if (status != next)
-        throw std::system_error(errno, std::system_category(), "sendmmsg failed");
-    for (int i = 0; i < next; i++)
-        if (msg_vec[i].msg_len != msg_iov[i].iov_len)
+    if (zc)
+        zc->reap();
+    if (ts)
+        ts->reap();
+    for (int i = 0; i < n; i++)
+        if (msg_vec[i].msg_len != msg_vec[i].msg_hdr.msg_iov->iov_len)
             throw std::runtime_error("short write");
 }
 
+void sendmmsg_transmit::send_packets(std::size_t first, std::size_t last,
+                                     time_point start)
+{
+    if (!prepared || prepared_version != collector.version())
+        prepare();
+    if (txtime)
+        set_txtimes(first, last, start);
+
+    mmsghdr *msg_vec = &messages[first];
+    int n = last - first;
+    if (use_timestamps)
+    {
+        send_times.resize(n);
+        for (int i = 0; i < n; i++)
+            send_times[i] = start + collector.packet_timestamp(first + i);
+    }
+    if (packet_socket.empty())
+    {
+        send_messages(fd, zerocopy.get(), timestamps.get(), msg_vec, send_times.data(), n);
+        return;
+    }
+
+    std::uint32_t sock = packet_socket[first];
+    std::size_t mixed = first + 1;
+    while (mixed < last && packet_socket[mixed] == sock)
+        mixed++;
+    if (mixed == last)
+    {
+        send_messages(sockets[sock].native_handle(),
+                      use_zerocopy ? connected_zerocopy[sock].get() : nullptr,
+                      use_timestamps ? connected_timestamps[sock].get() : nullptr,
+                      msg_vec, send_times.data(), n);
+        return;
+    }
+
+    /* Group the messages by socket, keeping the order within each socket
+     * (and hence within each flow), and send each group with one call.
+     */
+    order.clear();
+    for (std::size_t i = first; i < last; i++)
+        order.push_back(i);
+    std::stable_sort(order.begin(), order.end(), [this](std::uint32_t a, std::uint32_t b)
+    {
+        return packet_socket[a] < packet_socket[b];
+    });
+    grouped.resize(n);
+    for (int i = 0; i < n; i++)
+        grouped[i] = messages[order[i]];
+    if (use_timestamps)
+        for (int i = 0; i < n; i++)
+            send_times[i] = start + collector.packet_timestamp(order[i]);
+    for (int i = 0; i < n; )
+    {
+        sock = packet_socket[order[i]];
+        int j = i + 1;
+        while (j < n && packet_socket[order[j]] == sock)
+            j++;
+        send_messages(sockets[sock].native_handle(),
+                      use_zerocopy ? connected_zerocopy[sock].get() : nullptr,
+                      use_timestamps ? connected_timestamps[sock].get() : nullptr,
+                      grouped.data() + i, send_times.data() + i, j - i);
+        i = j;
+    }
+}
+
+void sendmmsg_transmit::flush()
+{
+    // Payloads may only be reused once the kernel has finished with them
+    if (zerocopy)
+        zerocopy->wait(0);
+    for (auto &zc : connected_zerocopy)
+        zc->wait(0);
+    if (timestamps)
+        timestamps->wait();
+    for (auto &ts : connected_timestamps)
+        ts->wait();
+}
+
 constexpr int sendmmsg_transmit::batch_size;
 
 #endif // HAVE_SENDMMSG
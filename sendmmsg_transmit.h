@@ -21,28 +21,102 @@
 
 #if HAVE_SENDMMSG
 
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <boost/asio.hpp>
 #include "common.h"
+#include "zerocopy.h"
+#include "tx_timestamps.h"
 
 class sendmmsg_transmit
 {
 public:
-    static constexpr int batch_size = 8;
+    static constexpr int batch_size = 8;    // default for --batch-size
 
 private:
+    struct free_deleter
+    {
+        void operator()(void *ptr) const { std::free(ptr); }
+    };
+
     basic_collector collector;
     boost::asio::ip::udp::socket socket;
     int fd;
+    bool use_zerocopy;
+    std::unique_ptr<zerocopy_tracker> zerocopy;   // null unless --zerocopy
+
+    /* Connected sockets, if the collector has few enough destinations.
+     * Each has its own zero-copy tracker, since completions are reported
+     * per socket.
+     */
+    connected_sockets sockets;
+    std::vector<std::unique_ptr<zerocopy_tracker>> connected_zerocopy;
+    std::vector<std::uint32_t> packet_socket;   // empty if not connected
+    std::vector<std::uint32_t> order;           // scratch for grouping by socket
+    std::vector<mmsghdr> grouped;               // scratch for grouping by socket
+
+    /* Ready-to-send messages for all the packets in the collector, so that
+     * each call hands a slice straight to the kernel. They are rebuilt when
+     * the collector changes (see basic_collector::version).
+     */
+    std::unique_ptr<mmsghdr[], free_deleter> messages;  // cache-line aligned
+    std::size_t messages_capacity = 0;
+    std::vector<iovec> iovecs;
+    std::vector<sockaddr_in> addresses;     // one per distinct destination
+    std::uint64_t prepared_version = 0;
+    bool prepared = false;
+
+    transmit_stats stats;
+
+    /* With --txtime, each message carries its launch time in a control
+     * message, which is filled in just before it is sent.
+     */
+    union txtime_control
+    {
+        char buf[CMSG_SPACE(sizeof(std::uint64_t))];
+        cmsghdr align;
+    };
+    bool txtime;
+    clockid_t txtime_clock;
+    std::size_t txtime_sockets = 0;         // connected sockets with SO_TXTIME enabled
+    std::vector<txtime_control> controls;
+
+    /* With --tx-timestamps, the kernel transmit timestamps of each socket,
+     * and the send times of the messages in the order they are sent.
+     */
+    bool use_timestamps;
+    std::unique_ptr<tx_timestamp_tracker> timestamps;
+    std::vector<std::unique_ptr<tx_timestamp_tracker>> connected_timestamps;
+    std::vector<time_point> send_times;
+
+    void prepare();
+    /// Enable SO_TXTIME on @a fd
+    void enable_txtime(int fd);
+    /// Fill in the launch times of messages [@a first, @a last)
+    void set_txtimes(std::size_t first, std::size_t last, time_point start);
+    /**
+     * Send all of @a msg_vec on @a fd, waiting for room and retrying partial
+     * sends and those that report ICMP errors. If @a ts is given, @a times
+     * holds the send times of the messages.
+     */
+    void send_messages(int fd, zerocopy_tracker *zc, tx_timestamp_tracker *ts,
+                       mmsghdr *msg_vec, const time_point *times, int n);
 
 public:
     typedef basic_collector collector_type;
 
     sendmmsg_transmit(const options &opts, boost::asio::io_service &io_service);
+    ~sendmmsg_transmit();
 
     collector_type &get_collector() { return collector; }
     void send_packets(std::size_t first, std::size_t last, time_point start);
-    void flush() {}
+    void flush();
+    const transmit_stats &get_stats() const { return stats; }
 };
 
 #endif // HAVE_SENDMMSG
@@ -0,0 +1,323 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_SHARDED_TRANSMIT_H
+#define UDPREPLAY_SHARDED_TRANSMIT_H
+
+#include <config.h>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <boost/asio.hpp>
+#include "common.h"
+
+/* Distributes packets between the collectors of several transmitters,
+ * either by destination (so that each flow stays in order) or round-robin.
+ * Packets keep their timestamps, so that each transmitter sends its share
+ * on the global schedule. It also records where each packet went, so that
+ * it can be queried by its overall index.
+ */
+template<typename Collector>
+class sharded_collector
+{
+private:
+    struct location
+    {
+        std::uint32_t shard;
+        std::uint32_t index;    // within the shard
+    };
+
+    std::vector<Collector *> shards;
+    std::vector<std::unique_ptr<Collector>> owned;  // for clones
+    std::vector<location> locations;
+    bool round_robin;
+    std::size_t next_shard = 0;
+    std::size_t total_bytes = 0;
+
+    std::size_t choose(const packet &pkt)
+    {
+        if (round_robin)
+        {
+            std::size_t shard = next_shard;
+            next_shard = (next_shard + 1) % shards.size();
+            return shard;
+        }
+        std::uint64_t key = (std::uint64_t(pkt.dst_host) << 16) | pkt.dst_port;
+        return (key * 0x9E3779B97F4A7C15ULL >> 32) % shards.size();
+    }
+
+    void add_location(std::size_t shard, std::size_t index)
+    {
+        if (index > std::numeric_limits<std::uint32_t>::max())
+            throw std::runtime_error("too many packets for one thread");
+        locations.push_back(location{std::uint32_t(shard), std::uint32_t(index)});
+    }
+
+public:
+    sharded_collector(std::vector<Collector *> shards, bool round_robin)
+        : shards(std::move(shards)), round_robin(round_robin)
+    {
+    }
+
+    void add_packet(const packet &pkt)
+    {
+        std::size_t shard = choose(pkt);
+        add_location(shard, shards[shard]->num_packets());
+        shards[shard]->add_packet(pkt);
+        total_bytes += pkt.len;
+    }
+
+    void keep_alive(std::shared_ptr<const void> owner)
+    {
+        for (Collector *shard : shards)
+            shard->keep_alive(owner);
+    }
+
+    std::size_t num_packets() const { return locations.size(); }
+
+    std::size_t packet_size(std::size_t idx) const
+    {
+        const location &loc = locations[idx];
+        return shards[loc.shard]->packet_size(loc.index);
+    }
+
+    duration packet_timestamp(std::size_t idx) const
+    {
+        const location &loc = locations[idx];
+        return shards[loc.shard]->packet_timestamp(loc.index);
+    }
+
+    std::size_t bytes() const { return total_bytes; }
+
+    void clear()
+    {
+        for (Collector *shard : shards)
+            shard->clear();
+        locations.clear();
+        next_shard = 0;
+        total_bytes = 0;
+    }
+
+    std::unique_ptr<sharded_collector> clone_empty() const
+    {
+        std::vector<std::unique_ptr<Collector>> clones;
+        std::vector<Collector *> ptrs;
+        for (Collector *shard : shards)
+        {
+            clones.push_back(shard->clone_empty());
+            ptrs.push_back(clones.back().get());
+        }
+        std::unique_ptr<sharded_collector> out(new sharded_collector(ptrs, round_robin));
+        out->owned = std::move(clones);
+        return out;
+    }
+
+    void append(sharded_collector &&other)
+    {
+        std::vector<std::size_t> offsets;
+        for (std::size_t i = 0; i < shards.size(); i++)
+        {
+            offsets.push_back(shards[i]->num_packets());
+            shards[i]->append(std::move(*other.shards[i]));
+        }
+        locations.reserve(locations.size() + other.locations.size());
+        for (const location &loc : other.locations)
+            add_location(loc.shard, offsets[loc.shard] + loc.index);
+        total_bytes += other.total_bytes;
+        other.locations.clear();
+        other.total_bytes = 0;
+    }
+
+    std::size_t num_shards() const { return shards.size(); }
+    std::size_t shard_packets(std::size_t shard) const { return shards[shard]->num_packets(); }
+
+    /// Number of packets among the first @a n that belong to @a shard
+    std::size_t count_before(std::size_t shard, std::size_t n) const
+    {
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < n; i++)
+            if (locations[i].shard == shard)
+                count++;
+        return count;
+    }
+};
+
+/* Several transmitters, each with its own socket (or queue) and collector,
+ * which are driven from their own threads (see run_shards). The threads
+ * last as long as the object, so that handing them work (which happens
+ * for every batch when streaming) does not create threads or re-pin them.
+ */
+template<typename Transmit>
+class sharded_transmit
+{
+public:
+    static constexpr int batch_size = Transmit::batch_size;
+    typedef sharded_collector<typename Transmit::collector_type> collector_type;
+
+private:
+    std::vector<std::unique_ptr<Transmit>> shards;
+    std::unique_ptr<collector_type> collector;
+    bool affinity;
+
+    // Work for the threads, protected by mutex
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable work_cond;      // signalled when a job is posted or on stop
+    std::condition_variable done_cond;      // signalled when the last thread finishes a job
+    std::function<void(Transmit &, std::size_t)> job;
+    std::uint64_t generation = 0;           // incremented for each job
+    std::size_t pending = 0;                // threads yet to finish the current job
+    std::vector<std::exception_ptr> errors; // from the current job, per shard
+    bool stopping = false;
+
+    void worker(std::size_t idx)
+    {
+        if (affinity)
+            set_thread_affinity(idx);
+        std::uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            work_cond.wait(lock, [this, seen] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            lock.unlock();
+            try
+            {
+                job(*shards[idx], idx);
+            }
+            catch (...)
+            {
+                errors[idx] = std::current_exception();
+            }
+            lock.lock();
+            if (--pending == 0)
+                done_cond.notify_one();
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_cond.notify_all();
+        for (std::thread &thread : threads)
+            thread.join();
+        threads.clear();
+    }
+
+    static std::vector<typename Transmit::collector_type *> shard_collectors(
+        const std::vector<std::unique_ptr<Transmit>> &shards)
+    {
+        std::vector<typename Transmit::collector_type *> out;
+        for (const auto &shard : shards)
+            out.push_back(&shard->get_collector());
+        return out;
+    }
+
+public:
+    sharded_transmit(const options &opts, boost::asio::io_service &io_service)
+        : affinity(opts.affinity)
+    {
+        for (int i = 0; i < opts.threads; i++)
+        {
+            options shard_opts = opts;
+            shard_opts.xdp_queue += i;    // each AF_XDP socket needs its own queue
+            shards.emplace_back(new Transmit(shard_opts, io_service));
+        }
+        collector.reset(new collector_type(shard_collectors(shards), opts.shard == "round-robin"));
+        errors.resize(shards.size());
+        try
+        {
+            for (std::size_t i = 0; i < shards.size(); i++)
+                threads.emplace_back(&sharded_transmit::worker, this, i);
+        }
+        catch (...)
+        {
+            stop();
+            throw;
+        }
+    }
+
+    ~sharded_transmit()
+    {
+        stop();
+    }
+
+    collector_type &get_collector() { return *collector; }
+
+    void flush()
+    {
+        for (auto &shard : shards)
+            shard->flush();
+    }
+
+    /// Totals so far over all the shards, which may be read from any thread
+    live_totals get_live() const
+    {
+        live_totals out;
+        for (const auto &shard : shards)
+            out += shard->get_live();
+        return out;
+    }
+
+    /// Totals over all the shards (only valid while they are not running)
+    transmit_stats get_stats() const
+    {
+        transmit_stats out;
+        for (const auto &shard : shards)
+            out += shard->get_stats();
+        return out;
+    }
+
+    /* Calls @a func(transmit, shard_index) for every shard, each in its own
+     * thread, and waits for them all to finish. If any of them throws, the
+     * exception from the lowest-numbered shard is rethrown.
+     */
+    template<typename F>
+    void run_shards(const F &func)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job = std::cref(func);
+        pending = shards.size();
+        generation++;
+        work_cond.notify_all();
+        done_cond.wait(lock, [this] { return pending == 0; });
+        job = nullptr;
+        std::exception_ptr first;
+        for (std::exception_ptr &error : errors)
+        {
+            if (error && !first)
+                first = error;
+            error = nullptr;
+        }
+        if (first)
+            std::rethrow_exception(first);
+    }
+};
+
+#endif // UDPREPLAY_SHARDED_TRANSMIT_H
@@ -0,0 +1,96 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_STREAM_H
+#define UDPREPLAY_STREAM_H
+
+#include <config.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include "common.h"
+
+/* Blocking queue with a fixed capacity, used to pass batches between the
+ * loader thread and the transmit thread. Once stopped, push fails and pop
+ * drains the remaining items before failing.
+ */
+template<typename T>
+class bounded_queue
+{
+private:
+    std::mutex mutex;
+    std::condition_variable data_cond;    // signalled when an item is added
+    std::condition_variable space_cond;   // signalled when an item is removed
+    std::deque<T> items;
+    std::size_t capacity;
+    bool stopped = false;
+
+public:
+    explicit bounded_queue(std::size_t capacity) : capacity(capacity) {}
+
+    /// Add an item, blocking while the queue is full. Returns false if stopped.
+    bool push(T &&item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cond.wait(lock, [this] { return stopped || items.size() < capacity; });
+        if (stopped)
+            return false;
+        items.push_back(std::move(item));
+        data_cond.notify_one();
+        return true;
+    }
+
+    /// Remove an item, blocking while the queue is empty. Returns false once
+    /// the queue is stopped and empty.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        data_cond.wait(lock, [this] { return stopped || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        space_cond.notify_one();
+        return true;
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        data_cond.notify_all();
+        space_cond.notify_all();
+    }
+};
+
+/// A chunk of a capture, as produced by the streaming loader
+struct packet_batch
+{
+    basic_collector packets;
+    bool end_of_pass = false;
+    /// Time offset between repetitions, only valid if end_of_pass is set
+    duration pass_duration{0};
+
+    void clear()
+    {
+        packets.clear();
+        end_of_pass = false;
+        pass_duration = duration(0);
+    }
+};
+
+#endif // UDPREPLAY_STREAM_H
@@ -0,0 +1,152 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <system_error>
+#include <stdexcept>
+#include <cerrno>
+#include <ctime>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#if HAVE_TX_TIMESTAMPS
+# include <linux/errqueue.h>
+# include <linux/net_tstamp.h>
+#endif
+#include "tx_timestamps.h"
+
+void tx_timestamp_tracker::add_timestamp(std::uint32_t id, time_point sent)
+{
+    // Packets before this one were not timestamped (the counter may wrap)
+    std::uint32_t skipped = id - next_id;
+    if (skipped >= pending.size())
+        return;     // not for a pending packet
+    stats.missing_timestamps += skipped;
+    pending.erase(pending.begin(), pending.begin() + skipped);
+    time_point scheduled = pending.front();
+    pending.pop_front();
+    next_id = id + 1;
+
+    stats.kernel_lateness.add(sent - scheduled);
+    if (have_prev)
+    {
+        duration error = (sent - prev_sent) - (scheduled - prev_scheduled);
+        stats.kernel_gap_error.add(error < duration::zero() ? -error : error);
+    }
+    prev_sent = sent;
+    prev_scheduled = scheduled;
+    have_prev = true;
+}
+
+#if HAVE_TX_TIMESTAMPS
+
+tx_timestamp_tracker::tx_timestamp_tracker(int fd, transmit_stats &stats)
+    : fd(fd), stats(stats)
+{
+    /* OPT_ID tags each timestamp with a per-socket packet counter, and
+     * OPT_TSONLY stops the kernel from queuing a copy of each packet too.
+     */
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+        | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(SO_TIMESTAMPING) failed");
+}
+
+void tx_timestamp_tracker::reap()
+{
+    // Software timestamps are on CLOCK_REALTIME
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    std::chrono::nanoseconds offset =
+        std::chrono::seconds(now.tv_sec) + std::chrono::nanoseconds(now.tv_nsec)
+        - time_point::clock::now().time_since_epoch();
+    while (true)
+    {
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(scm_timestamping))
+                     + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in))];
+            cmsghdr align;
+        } control;
+        msghdr msg = {};
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "recvmsg(MSG_ERRQUEUE) failed");
+        }
+        const scm_timestamping *tss = nullptr;
+        const sock_extended_err *serr = nullptr;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+                tss = (const scm_timestamping *) CMSG_DATA(cmsg);
+            else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                serr = (const sock_extended_err *) CMSG_DATA(cmsg);
+        }
+        if (!tss || !serr || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING
+            || serr->ee_info != SCM_TSTAMP_SND)
+            continue;
+        std::chrono::nanoseconds sent =
+            std::chrono::seconds(tss->ts[0].tv_sec) + std::chrono::nanoseconds(tss->ts[0].tv_nsec);
+        add_timestamp(serr->ee_data,
+                      time_point(std::chrono::duration_cast<duration>(sent - offset)));
+    }
+}
+
+void tx_timestamp_tracker::wait()
+{
+    reap();
+    while (!pending.empty())
+    {
+        // The error queue is signalled as POLLERR, which need not be requested
+        pollfd pfd = {};
+        pfd.fd = fd;
+        int status = poll(&pfd, 1, 100);
+        if (status < 0 && errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "poll failed");
+        if (status == 0)
+        {
+            // Timed out: the rest are not coming
+            stats.missing_timestamps += pending.size();
+            next_id += pending.size();
+            pending.clear();
+        }
+        reap();
+    }
+}
+
+#else // !HAVE_TX_TIMESTAMPS
+
+tx_timestamp_tracker::tx_timestamp_tracker(int fd, transmit_stats &stats)
+    : fd(fd), stats(stats)
+{
+    throw std::runtime_error("SO_TIMESTAMPING is not supported on this system");
+}
+
+void tx_timestamp_tracker::reap()
+{
+}
+
+void tx_timestamp_tracker::wait()
+{
+}
+
+#endif // !HAVE_TX_TIMESTAMPS
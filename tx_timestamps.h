@@ -0,0 +1,70 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_TX_TIMESTAMPS_H
+#define UDPREPLAY_TX_TIMESTAMPS_H
+
+#include <config.h>
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include "common.h"
+
+/* Collects the kernel's software transmit timestamps for the packets sent
+ * on a socket (SO_TIMESTAMPING), which record when the packet was handed
+ * to the device rather than when the send call was made. Each is matched
+ * to the packet's send time by the per-socket counter that the kernel
+ * includes with it, and added to the kernel_lateness and kernel_gap_error
+ * histograms of a transmit_stats, the latter measuring the gap from the
+ * previous packet on the socket.
+ *
+ * The timestamps are queued on the socket error queue, so this cannot be
+ * combined with zerocopy_tracker. If SO_TIMESTAMPING is not supported on
+ * this system, the constructor throws.
+ */
+class tx_timestamp_tracker : public boost::noncopyable
+{
+private:
+    int fd;
+    transmit_stats &stats;
+    std::uint32_t next_id = 0;              // counter of the first pending packet
+    std::deque<time_point> pending;         // send times of packets not yet timestamped
+    time_point prev_sent;
+    time_point prev_scheduled;
+    bool have_prev = false;
+
+    void add_timestamp(std::uint32_t id, time_point sent);
+
+public:
+    /// Enables SO_TIMESTAMPING on @a fd, and records the results in @a stats
+    tx_timestamp_tracker(int fd, transmit_stats &stats);
+
+    /// Record that packets with send times [@a first, @a last) were sent, in order
+    void add_sent(const time_point *first, const time_point *last)
+    {
+        pending.insert(pending.end(), first, last);
+    }
+    /// Read any available timestamps, without blocking
+    void reap();
+    /**
+     * Wait for the timestamps of all the packets sent, giving up on
+     * (and counting as missing) any that do not arrive within a short time.
+     */
+    void wait();
+};
+
+#endif // UDPREPLAY_TX_TIMESTAMPS_H
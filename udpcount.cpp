@@ -38,6 +38,7 @@
 #include <net/if.h>
 #include <poll.h>
 #include <sched.h>
+#include "metrics_export.h"
 #if HAVE_LINUX_IF_PACKET_H
 # include <linux/if_packet.h>
 # include <linux/if_ether.h>
@@ -62,6 +63,8 @@ struct options
     int threads = 0;
     int poll = 0;
     bool affinity = false;
+    std::string metrics_json = "";
+    std::string metrics_listen = "";
 };
 
 [[noreturn]] static void throw_errno()
@@ -85,6 +88,8 @@ static options parse_args(int argc, char **argv)
         ("mode,m", po::value<std::string>(&out.mode)->default_value(out.mode), "capture mode (asio/pcap/pfpacket)")
         ("threads,t", po::value<int>(&out.threads)->default_value(out.threads), "number of threads (0 for auto) (not all modes)")
         ("affinity", po::bool_switch(&out.affinity)->default_value(out.affinity), "use CPU affinity (not all modes)")
+        ("metrics-json", po::value<std::string>(&out.metrics_json), "file to append metrics to as JSON lines (- for stdout, in place of text)")
+        ("metrics-listen", po::value<std::string>(&out.metrics_listen), "serve Prometheus metrics on [HOST:]PORT or unix:PATH")
         ;
     try
     {
@@ -174,6 +179,10 @@ class runner
 {
 private:
     std::chrono::steady_clock::time_point last_stats;
+    metrics_exporter exporter;
+    // Totals of the counters that are reset each interval
+    std::int64_t total_errors = 0;
+    std::int64_t total_truncated = 0;
 
 protected:
     asio::io_service io_service;
@@ -189,12 +198,30 @@ protected:
     {
         typedef std::chrono::duration<double> duration_t;
         auto elapsed = std::chrono::duration_cast<duration_t>(now - last_stats).count();
-        counters.show_stats(elapsed);
+        if (!exporter.json_on_stdout())
+            counters.show_stats(elapsed);
+        if (exporter.enabled())
+        {
+            // Copy the counters, since the receive threads may be updating them
+            metrics<std::int64_t> current;
+            current += counters;
+            total_errors += current.errors;
+            total_truncated += current.truncated;
+            exporter.publish(std::vector<metric>{
+                {"packets_total", "counter", "Packets received", double(current.total_packets)},
+                {"bytes_total", "counter", "Bytes received", double(current.total_bytes)},
+                {"errors_total", "counter", "Receive errors", double(total_errors)},
+                {"truncated_total", "counter", "Packets truncated to --packet-size", double(total_truncated)},
+                {"packet_rate", "gauge", "Packets per second over the last interval", current.packets / elapsed},
+                {"bit_rate", "gauge", "Bits per second over the last interval", current.bytes * 8.0 / elapsed}
+            });
+        }
         counters.reset();
         last_stats = now;
     }
 
     explicit runner(const options &opts)
+        : exporter("udpcount", opts.metrics_json, opts.metrics_listen)
     {
         udp::resolver resolver(io_service);
         udp::resolver::query query(
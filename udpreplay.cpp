@@ -19,21 +19,39 @@
 #include <iostream>
 #include <memory>
 #include <vector>
-#include <unordered_map>
 #include <algorithm>
 #include <iomanip>
+#include <sstream>
+#include <fstream>
 #include <chrono>
 #include <stdexcept>
 #include <functional>
 #include <system_error>
+#include <future>
+#include <thread>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <pcap.h>
+#include <sys/uio.h>
 #include <boost/program_options.hpp>
 #include <boost/lexical_cast.hpp>
 #include "common.h"
 #include "asio_transmit.h"
 #include "sendmmsg_transmit.h"
+#include "gso_transmit.h"
 #include "ibv_transmit.h"
+#include "uring_transmit.h"
+#include "pfpacket_transmit.h"
+#include "xdp_transmit.h"
 #include "rate_transmit.h"
+#include "sharded_transmit.h"
+#include "stream.h"
+#include "pcap_file.h"
+#include "replay_cache.h"
+#include "reassembly.h"
+#include "profile.h"
+#include "metrics_export.h"
 
 namespace asio = boost::asio;
 namespace po = boost::program_options;
@@ -45,103 +63,163 @@ struct callback_data
     std::chrono::duration<double, duration::period> per_packet{0.0};
     std::chrono::duration<double, duration::period> per_byte{0.0};
     bool use_timestamps;
+    double speed = 1.0;                   // playback speed with use_timestamps
+    duration max_gap = duration::max();   // longest idle period with use_timestamps
     bool use_destination;
+    bool stable = false;   // whether the frames outlive the collector
     boost::asio::ip::udp::endpoint destination;
+    std::shared_ptr<reassembler> fragments;
     struct timeval start;
     std::uint64_t packets = 0;
     std::uint64_t bytes = 0;
+    duration last_timestamp{0};   // of the previous packet
+    duration skipped{0};          // idle time removed so far by max_gap
 };
 
-static std::unordered_map<uint64_t,
-           std::unordered_map<uint16_t, std::vector<u_char>>> pktbuf;
+/// IP-level information about a captured frame, as extracted by parse_frame
+struct parsed_frame
+{
+    const std::uint8_t *data;    // IP payload
+    std::size_t len;             // length of IP payload
+    struct timeval ts;
+    std::uint32_t src_host;      // big endian
+    std::uint32_t dst_host;      // big endian
+    std::uint16_t id;            // big endian
+    std::uint16_t frag_offs;     // in bytes
+    bool more_fragments;
 
-static void callback(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+    bool fragmented() const { return more_fragments || frag_offs != 0; }
+};
+
+/* Extracts the IP header information from a captured Ethernet frame. Returns
+ * false if the frame should be skipped. This has no side effects, so it can
+ * be run in parallel; the stateful part is in process_frame.
+ */
+static bool parse_frame(const struct pcap_pkthdr *h, const u_char *bytes, parsed_frame &out)
 {
     const unsigned int eth_hsize = 14;
     bpf_u_int32 len = h->caplen;
     if (h->len != len)
     {
         std::cerr << "Skipping truncated packet\n";
-        return;
+        return false;
     }
-    if (len > eth_hsize)
-    {
-        bytes += eth_hsize;
-        len -= eth_hsize;
-        const unsigned int ip_hsize = (bytes[0] & 0xf) * 4;
-
-        std::uint16_t id;
-        std::uint16_t frag_offs;
-        std::uint16_t flags;
-        std::uint64_t hosts;
-        std::uint32_t dst_host;  // big endian
+    if (len <= eth_hsize)
+        return false;
+    bytes += eth_hsize;
+    len -= eth_hsize;
+    const unsigned int ip_hsize = (bytes[0] & 0xf) * 4;
+    if (len < ip_hsize)
+        return false;
 
-        std::memcpy(&frag_offs, bytes + 6,  sizeof(frag_offs));
-        std::memcpy(&id,        bytes + 4,  sizeof(id));
-        std::memcpy(&hosts,     bytes + 12, sizeof(hosts));
-        std::memcpy(&dst_host,  bytes + 16, sizeof(dst_host));
+    std::uint16_t ip_len;
+    std::uint16_t frag_offs;
 
-        frag_offs = ntohs(frag_offs);
-        flags     = (frag_offs & 0xe000);
-        frag_offs = (frag_offs & 0x1fff) * 8;
+    std::memcpy(&ip_len,        bytes + 2,  sizeof(ip_len));
+    std::memcpy(&out.id,        bytes + 4,  sizeof(out.id));
+    std::memcpy(&frag_offs,     bytes + 6,  sizeof(frag_offs));
+    std::memcpy(&out.src_host,  bytes + 12, sizeof(out.src_host));
+    std::memcpy(&out.dst_host,  bytes + 16, sizeof(out.dst_host));
 
-        if (len >= ip_hsize + 8)
-        {
-            bytes += ip_hsize;
-            len -= ip_hsize;
+    ip_len    = ntohs(ip_len);
+    frag_offs = ntohs(frag_offs);
+    out.more_fragments = (frag_offs & 0x2000) != 0;
+    out.frag_offs = (frag_offs & 0x1fff) * 8;
 
-            if (pktbuf[hosts].count(id) == 0)
-            {
-                pktbuf[hosts][id] = std::vector<uint8_t>(65535, 0);
-            }
+    bytes += ip_hsize;
+    len -= ip_hsize;
+    // Exclude any Ethernet padding (a zero length indicates offload)
+    if (ip_len >= ip_hsize && len > ip_len - ip_hsize)
+        len = ip_len - ip_hsize;
+    out.data = bytes;
+    out.len = len;
+    out.ts = h->ts;
+    return true;
+}
 
-            auto& pbuf = pktbuf[hosts][id];
-            std::copy(bytes, bytes + len - 1, pbuf.begin() + frag_offs);
-            bytes = pbuf.data();
+/* Reassembles fragments, computes the transmit timestamp and destination,
+ * and passes complete datagrams to the collector.
+ */
+static void process_frame(callback_data *data, const parsed_frame &frame)
+{
+    const std::uint8_t *bytes = frame.data;
+    std::size_t len = frame.len;
+    std::uint32_t dst_host = frame.dst_host;
+    const bool fragmented = frame.fragmented();
+    if (fragmented)
+    {
+        fragment_key key{frame.src_host, frame.dst_host, frame.id};
+        auto now = std::chrono::seconds(frame.ts.tv_sec) + std::chrono::nanoseconds(frame.ts.tv_usec);
+        std::size_t datagram_len;
+        bytes = data->fragments->add_fragment(
+            key, now, frame.frag_offs, frame.more_fragments, bytes, len, datagram_len);
+        if (!bytes)
+            return;   // incomplete, or dropped
+        len = datagram_len;
+    }
 
-            if ((flags & 0x2000) == 0) //MF not set
-            {
-                std::uint16_t dst_port; // big endian
-                std::uint16_t udp_len;  // big endian
-                std::memcpy(&dst_port, bytes + 2, sizeof(dst_port));
-                std::memcpy(&udp_len,  bytes + 4, sizeof(udp_len));
-                udp_len = ntohs(udp_len) - 8;  // host endian
-                const unsigned int udp_hsize = 8;
-                bytes += udp_hsize;
-                len -= udp_hsize;
-
-                callback_data *data = (callback_data *) user;
-                duration timestamp;
-                if (data->use_timestamps)
-                {
-                    if (data->packets == 0)
-                        data->start = h->ts;
-                    auto ts = std::chrono::seconds(h->ts.tv_sec - data->start.tv_sec)
-                        + std::chrono::nanoseconds(h->ts.tv_usec - data->start.tv_usec);
-                    timestamp = std::chrono::duration_cast<duration>(ts);
-                }
-                else
-                {
-                    timestamp = std::chrono::duration_cast<duration>(
-                        data->per_byte * data->bytes + data->per_packet * data->packets);
-                }
-                if (!data->use_destination)
-                {
-                    asio::ip::address_v4::bytes_type dst_raw = data->destination.address().to_v4().to_bytes();
-                    std::memcpy(&dst_host, &dst_raw, sizeof(dst_host));
-                    dst_port = htons(data->destination.port());
-                }
+    const unsigned int udp_hsize = 8;
+    if (len < udp_hsize)
+        return;
+    std::uint16_t dst_port; // big endian
+    std::uint16_t udp_len;  // big endian
+    std::memcpy(&dst_port, bytes + 2, sizeof(dst_port));
+    std::memcpy(&udp_len,  bytes + 4, sizeof(udp_len));
+    if (ntohs(udp_len) > len)
+    {
+        std::cerr << "Skipping truncated datagram\n";
+        return;
+    }
+    udp_len = ntohs(udp_len) - 8;  // host endian
+    bytes += udp_hsize;
 
-                if (udp_len < 65508)
-                {
-                    packet p = {bytes, udp_len, timestamp, dst_host, dst_port};
-                    data->add_packet(p);
-                    data->packets++;
-                    data->bytes += udp_len;
-                }
-            }
+    duration timestamp;
+    if (data->use_timestamps)
+    {
+        if (data->packets == 0)
+        {
+            data->start = frame.ts;
+            data->last_timestamp = duration(0);
+            data->skipped = duration(0);
         }
+        auto ts = std::chrono::seconds(frame.ts.tv_sec - data->start.tv_sec)
+            + std::chrono::nanoseconds(frame.ts.tv_usec - data->start.tv_usec);
+        duration scaled = std::chrono::duration_cast<duration>(
+            std::chrono::duration<double, duration::period>(ts) / data->speed);
+        // Shrink idle periods, but not the spacing within bursts
+        duration gap = scaled - data->skipped - data->last_timestamp;
+        if (gap > data->max_gap)
+            data->skipped += gap - data->max_gap;
+        timestamp = scaled - data->skipped;
+        data->last_timestamp = timestamp;
+    }
+    else
+    {
+        timestamp = std::chrono::duration_cast<duration>(
+            data->per_byte * data->bytes + data->per_packet * data->packets);
+    }
+    if (!data->use_destination)
+    {
+        asio::ip::address_v4::bytes_type dst_raw = data->destination.address().to_v4().to_bytes();
+        std::memcpy(&dst_host, &dst_raw, sizeof(dst_host));
+        dst_port = htons(data->destination.port());
     }
+
+    if (udp_len < 65508)
+    {
+        packet p = {bytes, udp_len, timestamp, dst_host, dst_port,
+                    data->stable && !fragmented};
+        data->add_packet(p);
+        data->packets++;
+        data->bytes += udp_len;
+    }
+}
+
+static void callback(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+    parsed_frame frame;
+    if (parse_frame(h, bytes, frame))
+        process_frame((callback_data *) user, frame);
 }
 
 static void generate_packets(callback_data &data, std::size_t packet_size, int addresses)
@@ -173,50 +251,752 @@ static void generate_packets(callback_data &data, std::size_t packet_size, int a
     }
 }
 
-static void prepare(pcap_t *p)
+/// BPF expression selecting the frames to load
+static std::string filter_expression(const options &opts)
 {
-    struct bpf_program fp;
-    if (pcap_datalink(p) != DLT_EN10MB)
+    if (opts.filter.empty())
+        return "udp";
+    else
+        return "udp and (" + opts.filter + ")";
+}
+
+static frame_range make_range(const options &opts)
+{
+    auto to_ns = [](double seconds)
+    {
+        if (seconds >= std::chrono::duration<double>(std::chrono::nanoseconds::max()).count())
+            return std::chrono::nanoseconds::max();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(seconds));
+    };
+    frame_range range;
+    range.start_index = opts.start_index;
+    range.end_index = opts.end_index;
+    range.start_time = to_ns(opts.start_time);
+    range.end_time = to_ns(opts.end_time);
+    return range;
+}
+
+static bool has_range(const options &opts)
+{
+    const options defaults;
+    return opts.start_index != defaults.start_index
+        || opts.end_index != defaults.end_index
+        || opts.start_time != defaults.start_time
+        || opts.end_time != defaults.end_time;
+}
+
+/* Opens the input files, merging them into timestamp order if there is more
+ * than one. The range is applied to the merged capture, before filtering,
+ * so that frame indices match those shown by other tools.
+ */
+static std::unique_ptr<frame_source> open_inputs(const options &opts)
+{
+    std::vector<std::unique_ptr<frame_source>> inputs;
+    for (const std::string &filename : opts.input_files)
+    {
+        if (opts.mmap)
+            inputs.emplace_back(new mapped_source(filename));
+        else
+            inputs.emplace_back(new pcap_source(filename));
+    }
+    std::unique_ptr<frame_source> source;
+    if (inputs.size() == 1)
+        source = std::move(inputs[0]);
+    else
+        source.reset(new merged_source(std::move(inputs)));
+    if (has_range(opts))
+        source.reset(new range_source(std::move(source), make_range(opts)));
+    return std::unique_ptr<frame_source>(
+        new filtered_source(std::move(source), filter_expression(opts)));
+}
+
+/* Passes all frames from a source to the collector. If the source can keep
+ * its frames alive (such as a memory-mapped file), the collector refers to
+ * unfragmented payloads in place instead of copying them.
+ */
+template<typename Collector>
+static void load_frames(frame_source &source, callback_data &data, Collector &collector)
+{
+    std::shared_ptr<const void> owner = source.owner();
+    if (owner)
+    {
+        collector.keep_alive(owner);
+        data.stable = true;
+    }
+
+    pcap_pkthdr header;
+    const std::uint8_t *bytes;
+    while (source.next(header, bytes))
+        callback((u_char *) &data, &header, bytes);
+}
+
+/* Loads the capture using several threads. Frames outside the selected
+ * range are skipped by walking the record headers, and the rest is
+ * processed in windows of up to 64 MiB per thread. For each window
+ *  1. record boundaries are found by walking the record headers, and the
+ *     window is split into one chunk per thread;
+ *  2. the threads filter their chunks and parse the frame headers;
+ *  3. the parsed frames are processed in order, since reassembly,
+ *     timestamps and destinations depend on the preceding packets;
+ *  4. the threads copy the payloads (or build frames) into collectors of
+ *     their own, which are then appended to @a collector in order.
+ * If @a writer is non-null, the packets are also written to it.
+ */
+template<typename Collector>
+static void load_parallel(callback_data &data, Collector &collector,
+                          cache_writer *writer, const options &opts)
+{
+    const std::size_t window_per_thread = 64 * 1024 * 1024;
+    std::size_t threads = opts.load_threads;
+    if (threads == 0)
+        threads = std::max(1U, std::thread::hardware_concurrency());
+
+    mapped_capture cap(opts.input_files[0]);
+    if (cap.datalink() != DLT_EN10MB)
         throw std::runtime_error("Capture does not contain Ethernet frames");
-    if (pcap_compile(p, &fp, "udp", 1, PCAP_NETMASK_UNKNOWN) == -1)
-        throw std::runtime_error("Failed to parse filter");
-    if (pcap_setfilter(p, &fp) == -1)
+    capture_filter filter(cap.datalink(), filter_expression(opts));
+    if (opts.mmap)
+        collector.keep_alive(cap.owner());
+
+    std::vector<std::vector<parsed_frame>> parsed(threads);
+    std::vector<packet> pending;
+    // Copies of reassembled datagrams, which the reassembler does not keep
+    std::deque<std::vector<std::uint8_t>> reassembled;
+    data.stable = true;     // the mapping outlives each window
+    data.add_packet = [&](const packet &pkt)
+    {
+        pending.push_back(pkt);
+        if (!pkt.stable)
+        {
+            reassembled.emplace_back(pkt.data, pkt.data + pkt.len);
+            pending.back().data = reassembled.back().data();
+        }
+        else
+            pending.back().stable = opts.mmap;
+    };
+
+    const frame_range range = make_range(opts);
+    std::uint64_t index = 0;
+    timeval origin = {};
+    pcap_pkthdr header;
+    const std::uint8_t *bytes;
+    std::size_t pos = cap.begin();
+    std::size_t end = cap.end();
+    for (std::size_t cur = pos; cap.read(cur, header, bytes); pos = cur, index++)
     {
-        pcap_freecode(&fp);
-        throw std::runtime_error("Failed to set filter");
+        if (index == 0)
+            origin = header.ts;
+        if (!range.before_start(index, frame_range::offset(origin, header.ts)))
+            break;
     }
-    pcap_freecode(&fp);
+
+    while (pos < end)
+    {
+        // Step 1: split the window into chunks, stopping at the end of the range
+        std::vector<std::size_t> bounds{pos};
+        for (std::size_t t = 0; t < threads; t++)
+        {
+            std::size_t limit = pos + window_per_thread;
+            while (pos < limit && pos < end)
+            {
+                std::size_t cur = pos;
+                if (!cap.read(cur, header, bytes)
+                    || range.past_end(index, frame_range::offset(origin, header.ts)))
+                {
+                    end = pos;
+                    break;
+                }
+                pos = cur;
+                index++;
+            }
+            bounds.push_back(pos);
+        }
+        if (bounds.front() == pos)
+            break;    // only a partial record remains
+
+        // Step 2: parse the chunks
+        std::vector<std::future<void>> futures;
+        for (std::size_t t = 0; t < threads; t++)
+        {
+            futures.push_back(std::async(std::launch::async, [&, t]
+            {
+                pcap_pkthdr header;
+                const std::uint8_t *bytes;
+                std::size_t cur = bounds[t];
+                parsed[t].clear();
+                while (cur < bounds[t + 1] && cap.read(cur, header, bytes))
+                {
+                    parsed_frame frame;
+                    if (filter(header, bytes) && parse_frame(&header, bytes, frame))
+                        parsed[t].push_back(frame);
+                }
+            }));
+        }
+        for (auto &future : futures)
+            future.get();
+        futures.clear();
+
+        // Step 3: sequential processing
+        pending.clear();
+        reassembled.clear();
+        for (const auto &chunk : parsed)
+            for (const parsed_frame &frame : chunk)
+                process_frame(&data, frame);
+
+        // Step 4: fill the collectors
+        std::vector<std::unique_ptr<Collector>> parts;
+        for (std::size_t t = 0; t < threads; t++)
+        {
+            parts.push_back(collector.clone_empty());
+            std::size_t first = pending.size() * t / threads;
+            std::size_t last = pending.size() * (t + 1) / threads;
+            Collector &part = *parts.back();
+            futures.push_back(std::async(std::launch::async, [&, first, last]
+            {
+                for (std::size_t i = first; i < last; i++)
+                    part.add_packet(pending[i]);
+            }));
+        }
+        if (writer)
+        {
+            futures.push_back(std::async(std::launch::async, [&]
+            {
+                for (const packet &pkt : pending)
+                    writer->add_packet(pkt);
+            }));
+        }
+        for (auto &future : futures)
+            future.get();
+        for (auto &part : parts)
+            collector.append(std::move(*part));
+    }
+}
+
+static void show_reassembly_stats(const reassembler &fragments)
+{
+    const reassembler::counters &stats = fragments.get_counters();
+    if (stats.reassembled || stats.evicted || stats.dropped)
+    {
+        std::cout << "Fragmented datagrams: " << stats.reassembled << " reassembled, "
+            << stats.evicted << " incomplete, " << stats.dropped << " malformed\n";
+    }
+}
+
+/* Describes the options that affect the packets produced by the loader, so
+ * that a replay cache is rebuilt when they change.
+ */
+static std::string cache_params(const callback_data &data, const options &opts)
+{
+    std::ostringstream params;
+    params << std::setprecision(17)
+        << "reassembly_slots=" << opts.reassembly_slots
+        << " reassembly_timeout=" << opts.reassembly_timeout
+        << " per_packet=" << data.per_packet.count()
+        << " per_byte=" << data.per_byte.count()
+        << " use_timestamps=" << data.use_timestamps
+        << " speed=" << data.speed
+        << " max_gap=" << data.max_gap.count()
+        << " filter=" << filter_expression(opts)
+        << " index=" << opts.start_index << ':' << opts.end_index
+        << " time=" << opts.start_time << ':' << opts.end_time;
+    if (data.use_destination)
+        params << " destination=original";
+    else
+        params << " destination=" << data.destination;
+    return params.str();
+}
+
+/* Loads a capture file into the collector. If a replay cache is requested,
+ * it is used if it is up to date, and otherwise rebuilt as a side effect of
+ * loading the capture.
+ */
+template<typename Collector>
+static void load_capture(callback_data &data, Collector &collector, const options &opts)
+{
+    std::unique_ptr<cache_writer> writer;
+    if (!opts.cache_file.empty())
+    {
+        cache_key key(opts.input_files, cache_params(data, opts));
+        std::unique_ptr<mapped_cache> cache = mapped_cache::open(opts.cache_file, key);
+        if (cache)
+        {
+            for (std::size_t i = 0; i < cache->num_packets(); i++)
+                collector.add_packet(cache->get_packet(i));
+            collector.keep_alive(cache->owner());
+            data.packets = cache->num_packets();
+            data.bytes = cache->bytes();
+            std::cout << "Loaded " << data.packets << " packets from " << opts.cache_file << std::endl;
+            return;
+        }
+        std::cout << "Building cache " << opts.cache_file << std::endl;
+        writer.reset(new cache_writer(opts.cache_file, key));
+        if (opts.load_threads == 1)
+        {
+            auto add_packet = data.add_packet;
+            data.add_packet = [&writer, add_packet](const packet &pkt)
+            {
+                writer->add_packet(pkt);
+                add_packet(pkt);
+            };
+        }
+    }
+
+    if (opts.load_threads != 1)
+        load_parallel(data, collector, writer.get(), opts);
+    else
+        load_frames(*open_inputs(opts), data, collector);
+    data.fragments->flush();
+    if (writer)
+        writer->commit();
+    show_reassembly_stats(*data.fragments);
+}
+
+/// Metrics for the totals since startup and the rates over the last @a elapsed seconds
+static std::vector<metric> live_metrics(const live_totals &totals, const live_totals &delta,
+                                        double elapsed)
+{
+    return std::vector<metric>{
+        {"packets_total", "counter", "Packets sent", double(totals.packets)},
+        {"bytes_total", "counter", "Bytes sent", double(totals.bytes)},
+        {"late_packets_total", "counter", "Packets sent more than --late-threshold late", double(totals.late)},
+        {"dropped_packets_total", "counter", "Packets dropped by --late-policy=drop", double(totals.dropped)},
+        {"icmp_errors_total", "counter", "ICMP errors for earlier datagrams reported by sends (which were retried)", double(totals.icmp_errors)},
+        {"packet_rate", "gauge", "Packets per second over the last interval (or run, at the end)", delta.packets / elapsed},
+        {"bit_rate", "gauge", "Bits per second over the last interval (or run, at the end)", delta.bytes * 8.0 / elapsed}
+    };
 }
 
+/// Add the percentiles of @a hist to @a out, in seconds
+static void add_histogram_metrics(std::vector<metric> &out, const std::string &name,
+                                  const char *help, const histogram &hist)
+{
+    if (hist.count() == 0)
+        return;
+    static const struct { const char *suffix; double pct; } pcts[] =
+    {
+        {"_p50_seconds", 50}, {"_p99_seconds", 99}, {"_p999_seconds", 99.9}
+    };
+    for (const auto &p : pcts)
+    {
+        std::chrono::duration<double> value = hist.percentile(p.pct);
+        out.push_back(metric{name + p.suffix, "gauge", help, value.count()});
+    }
+    std::chrono::duration<double> max = hist.max();
+    out.push_back(metric{name + "_max_seconds", "gauge", help, max.count()});
+}
+
+/// Metrics for the end of a run, with the rates averaged over the run
+static std::vector<metric> summary_metrics(const live_totals &totals, const live_totals &sent,
+                                           double elapsed, const transmit_stats &stats)
+{
+    std::vector<metric> out = live_metrics(totals, sent, elapsed);
+    out.push_back(metric{"run_seconds", "gauge", "Duration of the last run", elapsed});
+    add_histogram_metrics(out, "send_lateness", "Lateness of send calls in the last run",
+                          stats.lateness);
+    add_histogram_metrics(out, "gap_error", "Inter-packet gap error of send calls in the last run",
+                          stats.gap_error);
+    add_histogram_metrics(out, "kernel_send_lateness", "Lateness of kernel transmit timestamps in the last run",
+                          stats.kernel_lateness);
+    add_histogram_metrics(out, "kernel_gap_error", "Inter-packet gap error of kernel transmit timestamps in the last run",
+                          stats.kernel_gap_error);
+    return out;
+}
+
+static void show_summary(const live_totals &sent,
+                         time_point start, time_point stop, const transmit_stats &stats,
+                         const options &opts)
+{
+    std::uint64_t total_bytes = sent.bytes;
+    std::uint64_t total_packets = sent.packets;
+    if (interrupted())
+        std::cout << "Interrupted\n";
+    std::chrono::duration<double> elapsed = stop - start;
+    double time = elapsed.count();
+    std::cout << "Transmitted " << total_bytes << " bytes / "
+        << total_packets << " packets in " << time << "s = "
+        << total_bytes * 8.0 / time / 1e9 << "Gbps\n";
+    // With a profile there is no single target rate to compare against
+    if (opts.profile.empty())
+    {
+        if (opts.pps != 0)
+        {
+            double achieved = total_packets / time;
+            std::cout << "Achieved " << achieved << " of " << opts.pps << " packets/s ("
+                << achieved / opts.pps * 100.0 << "%)\n";
+        }
+        else if (opts.mbps != 0)
+        {
+            double achieved = total_bytes * 8.0 / time / 1e6;
+            std::cout << "Achieved " << achieved << " of " << opts.mbps << " Mb/s ("
+                << achieved / opts.mbps * 100.0 << "%)\n";
+        }
+    }
+    stats.show(std::cout);
+}
+
+static void publish_summary(metrics_exporter &metrics, const live_totals &totals,
+                            const live_totals &sent, time_point start, time_point stop,
+                            const transmit_stats &stats)
+{
+    if (metrics.enabled())
+    {
+        std::chrono::duration<double> elapsed = stop - start;
+        metrics.publish(summary_metrics(totals, sent, elapsed.count(), stats));
+    }
+}
+
+static void wait_for_user(const options &opts)
+{
+    if (opts.pause && !interrupted())
+    {
+        std::cout << "Press enter when ready for next repetition: " << std::flush;
+        std::string dummy;
+        getline(std::cin, dummy);
+    }
+}
+
+/* Replaces the contents of a transmitter's collector with a batch loaded by
+ * the streaming loader. The batch is left in an unspecified state. The
+ * generic version copies the packets; basic_collector just swaps storage.
+ */
+template<typename Collector>
+static void load_batch(Collector &collector, basic_collector &batch)
+{
+    collector.clear();
+    for (std::size_t i = 0; i < batch.num_packets(); i++)
+        collector.add_packet(batch.get_packet(i));
+}
+
+static void load_batch(basic_collector &collector, basic_collector &batch)
+{
+    collector.swap(batch);
+}
+
+typedef bounded_queue<std::unique_ptr<packet_batch>> batch_queue;
+
+/* Reads the capture (once per repetition) and passes it to the transmit
+ * thread in batches through @a filled_batches. Empty batches are taken from
+ * @a free_batches, so the number of batches in existence (and hence the
+ * memory usage) is bounded. Returns early if either queue is stopped.
+ */
+static void stream_loader(const options &opts, callback_data data,
+                          batch_queue &free_batches, batch_queue &filled_batches)
+{
+    const bool forever = opts.repeat == 0;
+    for (std::uint64_t pass = 0; forever || pass < opts.repeat; pass++)
+    {
+        std::unique_ptr<frame_source> source = open_inputs(opts);
+
+        std::unique_ptr<packet_batch> batch;
+        if (!free_batches.pop(batch))
+            return;
+        bool stopped = false;
+        duration last_timestamp{0};
+        data.packets = 0;
+        data.bytes = 0;
+        data.add_packet = [&](const packet &pkt)
+        {
+            if (stopped)
+                return;
+            if (batch->packets.num_packets() >= opts.stream_batch)
+            {
+                if (!filled_batches.push(std::move(batch)) || !free_batches.pop(batch))
+                {
+                    stopped = true;
+                    return;
+                }
+                batch->clear();
+            }
+            batch->packets.add_packet(pkt);
+            last_timestamp = pkt.timestamp;
+        };
+        pcap_pkthdr header;
+        const std::uint8_t *bytes;
+        while (!stopped && source->next(header, bytes))
+            callback((u_char *) &data, &header, bytes);
+        if (stopped)
+            return;
+        data.fragments->flush();
+        if (data.packets == 0)
+            throw std::runtime_error("No packets found in capture");
+
+        batch->end_of_pass = true;
+        if (opts.use_timestamps)
+            batch->pass_duration = last_timestamp;
+        else
+            batch->pass_duration = std::chrono::duration_cast<duration>(
+                data.per_byte * data.bytes + data.per_packet * data.packets);
+        if (!filled_batches.push(std::move(batch)))
+            return;
+    }
+}
+
+/* Reports the totals and rates of a transmitter once per interval while it
+ * runs, from a thread of its own: as text in the same form as udpcount,
+ * and to the metrics exporter. Only the transmitter's live counters are
+ * read.
+ */
 template<typename Transmit>
-static void run(pcap_t *p, const options &opts)
+class stats_reporter
 {
-    boost::asio::io_service io_service;
+private:
+    const Transmit &t;
+    metrics_exporter &metrics;
+    const bool text;
+    const live_totals base;     // totals before this run
+    std::chrono::steady_clock::duration interval;
+    std::mutex mutex;
+    std::condition_variable stop_cond;
+    bool stopped = false;
+    std::thread thread;
 
-    Transmit t(opts, io_service);
-    typedef typename Transmit::collector_type Collector;
-    callback_data data;
-    Collector &collector = t.get_collector();
-    data.add_packet = [&collector](const packet &pkt) { collector.add_packet(pkt); };
-    if (opts.mbps != 0)
-        data.per_byte = std::chrono::duration<double, std::micro>(8.0 / opts.mbps);
-    if (opts.pps != 0)
-        data.per_packet = std::chrono::duration<double>(1.0 / opts.pps);
-    data.use_timestamps = opts.use_timestamps;
-    data.use_destination = opts.use_destination;
-    if (!opts.use_destination)
+    void run()
     {
-        udp::resolver resolver(io_service);
-        udp::resolver::query query(udp::v4(), opts.host, opts.port);
-        data.destination = *resolver.resolve(query);
+        live_totals last = base;
+        auto last_time = std::chrono::steady_clock::now();
+        auto next = last_time;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop_cond.wait_until(lock, next += interval, [this] { return stopped; }))
+        {
+            live_totals totals = t.get_live();
+            auto now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - last_time).count();
+            live_totals delta = totals - last;
+            live_totals run = totals - base;
+            if (text)
+            {
+                std::cout << run.packets << " (" << delta.packets / elapsed << ") packets\t"
+                    << run.bytes << " bytes ("
+                    << delta.bytes * 8.0 / 1e9 / elapsed << " Gb/s)\t"
+                    << run.late << " late\t" << run.dropped << " dropped\t"
+                    << run.icmp_errors << " ICMP errors" << std::endl;
+            }
+            if (metrics.enabled())
+                metrics.publish(live_metrics(totals, delta, elapsed));
+            last = totals;
+            last_time = now;
+        }
     }
 
-    if (p)
-        pcap_loop(p, -1, callback, (u_char *) &data);
+public:
+    stats_reporter(const Transmit &t, metrics_exporter &metrics, bool text, double interval)
+        : t(t), metrics(metrics), text(text), base(t.get_live()),
+        interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(interval))),
+        thread([this] { run(); })
+    {
+    }
+
+    ~stats_reporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        stop_cond.notify_all();
+        thread.join();
+    }
+};
+
+/* Starts a reporter for @a t if --stats-interval is set or metrics are
+ * exported (every second, if not set), otherwise returns null. JSON lines
+ * on stdout replace the text reports.
+ */
+template<typename Transmit>
+static std::unique_ptr<stats_reporter<Transmit>> start_reporter(
+    const Transmit &t, metrics_exporter &metrics, const options &opts)
+{
+    bool text = opts.stats_interval > 0 && !metrics.json_on_stdout();
+    if (!text && !metrics.enabled())
+        return nullptr;
+    double interval = opts.stats_interval > 0 ? opts.stats_interval : 1.0;
+    return std::unique_ptr<stats_reporter<Transmit>>(
+        new stats_reporter<Transmit>(t, metrics, text, interval));
+}
+
+/// Number of packets to pass to the transmitter at a time
+template<typename Transmit>
+static std::size_t get_batch_size(const options &opts)
+{
+    if (opts.batch_size != 0)
+        return opts.batch_size;
     else
+        return Transmit::batch_size;
+}
+
+/* Sends the first @a limit packets in the collector, for a pass that
+ * starts at @a rep_start.
+ */
+template<typename Transmit>
+static void send_pass(Transmit &t, std::size_t limit, time_point rep_start,
+                      std::size_t batch_size)
+{
+    for (std::size_t i = 0; i < limit && !interrupted(); i += batch_size)
+    {
+        std::size_t end = std::min(i + batch_size, limit);
+        t.send_packets(i, end, rep_start);
+    }
+}
+
+template<typename Transmit>
+static void send_pass(sharded_transmit<Transmit> &t, std::size_t limit, time_point rep_start,
+                      std::size_t batch_size)
+{
+    const auto &collector = t.get_collector();
+    bool all = limit == collector.num_packets();
+    t.run_shards([&](Transmit &shard, std::size_t idx)
+    {
+        std::size_t shard_limit = all
+            ? shard.get_collector().num_packets() : collector.count_before(idx, limit);
+        send_pass(shard, shard_limit, rep_start, batch_size);
+    });
+}
+
+/* Sends @a passes complete passes over the collector followed by the first
+ * @a last_pass packets (or passes forever), then flushes the transmitter.
+ */
+template<typename Transmit>
+static void send_passes(
+    Transmit &t, std::size_t num_packets,
+    std::uint64_t passes, std::size_t last_pass, bool forever,
+    time_point start, std::chrono::duration<double, duration::period> rep_step,
+    std::size_t batch_size)
+{
+    for (std::uint64_t pass = 0; (forever || pass <= passes) && !interrupted(); pass++)
+    {
+        time_point rep_start = start + std::chrono::duration_cast<duration>(pass * rep_step);
+        std::size_t limit = (forever || pass < passes) ? num_packets : last_pass;
+        send_pass(t, limit, rep_start, batch_size);
+    }
+    t.flush();
+}
+
+/* Each thread makes all the passes over its own share of the packets, on
+ * the common schedule.
+ */
+template<typename Transmit>
+static void send_passes(
+    sharded_transmit<Transmit> &t, std::size_t num_packets,
+    std::uint64_t passes, std::size_t last_pass, bool forever,
+    time_point start, std::chrono::duration<double, duration::period> rep_step,
+    std::size_t batch_size)
+{
+    const auto &collector = t.get_collector();
+    std::size_t idle = 0;
+    for (std::size_t i = 0; i < collector.num_shards(); i++)
+        if (collector.shard_packets(i) == 0)
+            idle++;
+    if (idle > 0)
+    {
+        std::cout << idle << " of " << collector.num_shards() << " threads have no packets"
+            << " (use --shard=round-robin to spread packets to the same destination)\n";
+    }
+
+    t.run_shards([&](Transmit &shard, std::size_t idx)
+    {
+        std::size_t shard_packets = shard.get_collector().num_packets();
+        if (shard_packets == 0)
+            return;
+        send_passes(shard, shard_packets, passes, collector.count_before(idx, last_pass),
+                    forever, start, rep_step, batch_size);
+    });
+}
+
+template<typename Transmit>
+static void run_stream(Transmit &t, const callback_data &data, const options &opts,
+                       metrics_exporter &metrics)
+{
+    typedef typename Transmit::collector_type Collector;
+    Collector &collector = t.get_collector();
+    const std::size_t batch_size = get_batch_size<Transmit>(opts);
+    catch_interrupts();
+
+    do
+    {
+        batch_queue free_batches(opts.stream_depth);
+        batch_queue filled_batches(opts.stream_depth);
+        for (std::size_t i = 0; i < opts.stream_depth; i++)
+            free_batches.push(std::unique_ptr<packet_batch>(new packet_batch));
+        auto loader = std::async(std::launch::async, [&]
+        {
+            try
+            {
+                stream_loader(opts, data, free_batches, filled_batches);
+            }
+            catch (...)
+            {
+                filled_batches.stop();
+                throw;
+            }
+            filled_batches.stop();
+        });
+
+        std::cout << "Streaming capture, starting transmission" << std::endl;
+        const transmit_stats start_stats = t.get_stats();
+        const live_totals start_live = t.get_live();
+        auto reporter = start_reporter(t, metrics, opts);
+        time_point start, rep_start, stop;
+        start = std::chrono::high_resolution_clock::now();
+        rep_start = start;
+        std::unique_ptr<packet_batch> batch;
+        try
+        {
+            while (!interrupted() && filled_batches.pop(batch))
+            {
+                // The transmitter may still be using the previous batch
+                t.flush();
+                load_batch(collector, batch->packets);
+                std::size_t num_packets = collector.num_packets();
+                send_pass(t, num_packets, rep_start, batch_size);
+                if (batch->end_of_pass)
+                    rep_start += batch->pass_duration;
+                batch->clear();
+                free_batches.push(std::move(batch));
+            }
+            t.flush();
+        }
+        catch (...)
+        {
+            free_batches.stop();
+            filled_batches.stop();
+            loader.wait();
+            throw;
+        }
+        if (interrupted())
+        {
+            // Stop the loader too
+            free_batches.stop();
+            filled_batches.stop();
+        }
+        loader.get();   // rethrows any error from the loader
+        stop = std::chrono::high_resolution_clock::now();
+        reporter.reset();
+        const live_totals totals = t.get_live();
+        const transmit_stats stats = t.get_stats() - start_stats;
+        show_summary(totals - start_live, start, stop, stats, opts);
+        publish_summary(metrics, totals, totals - start_live, start, stop, stats);
+        show_reassembly_stats(*data.fragments);
+        wait_for_user(opts);
+    } while (opts.pause && !interrupted());
+}
+
+template<typename Transmit>
+static void run_loaded(Transmit &t, callback_data &data, const options &opts,
+                       metrics_exporter &metrics)
+{
+    typedef typename Transmit::collector_type Collector;
+    Collector &collector = t.get_collector();
+    data.add_packet = [&collector](const packet &pkt) { collector.add_packet(pkt); };
+
+    if (opts.packet_size != 0)
         generate_packets(data, opts.packet_size, opts.addresses);
+    else
+        load_capture(data, collector, opts);
 
     std::size_t num_packets = collector.num_packets();
+    if (num_packets == 0)
+        throw std::runtime_error("No packets found in capture");
 
     /* Time offset between the equivalent packets in each repetition. */
     std::chrono::duration<double, duration::period> rep_step;
@@ -226,19 +1006,23 @@ static void run(pcap_t *p, const options &opts)
         rep_step = data.per_byte * data.bytes + data.per_packet * data.packets;
 
     std::cout << "Packets loading, starting transmission" << std::endl;
+    catch_interrupts();
 
     do
     {
-        time_point start, rep_start, stop;
+        const transmit_stats start_stats = t.get_stats();
+        const live_totals start_live = t.get_live();
+        auto reporter = start_reporter(t, metrics, opts);
+        time_point start, stop;
         start = std::chrono::high_resolution_clock::now();
-        const std::size_t batch_size = opts.use_timestamps ? 1 : Transmit::batch_size;
+        const std::size_t batch_size = get_batch_size<Transmit>(opts);
 
         std::uint64_t passes = 0;
         std::uint64_t last_pass = 0;
         bool forever = false;
         if (opts.repeat == 0)
             forever = true;
-        else if (!p)
+        else if (opts.packet_size != 0)
         {
             // --repeat specifies number of packets to send, but we have a number of
             // packets in the collector so we have to break it into repeats plus
@@ -251,35 +1035,65 @@ static void run(pcap_t *p, const options &opts)
             passes = opts.repeat;
         }
 
-        for (std::uint64_t pass = 0; forever || pass <= passes; pass++)
-        {
-            rep_start = start + std::chrono::duration_cast<duration>(pass * rep_step);
-            std::size_t limit = (forever || pass < passes) ? num_packets : last_pass;
-            for (std::size_t i = 0; i < limit; i += batch_size)
-            {
-                std::size_t end = std::min(i + batch_size, limit);
-                t.send_packets(i, end, rep_start);
-            }
-        }
-        t.flush();
+        send_passes(t, num_packets, passes, last_pass, forever, start, rep_step, batch_size);
         stop = std::chrono::high_resolution_clock::now();
-        std::chrono::duration<double> elapsed = stop - start;
-        std::uint64_t total_bytes = collector.bytes() * passes;
-        std::uint64_t total_packets = num_packets * passes + last_pass;
-        for (std::size_t i = 0; i < last_pass; i++)
-            total_bytes += collector.packet_size(i);
-
-        double time = elapsed.count();
-        std::cout << "Transmitted " << total_bytes << " bytes / "
-            << total_packets << " packets in " << time << "s = "
-            << total_bytes * 8.0 / time / 1e9 << "Gbps\n";
-        if (opts.pause)
-        {
-            std::cout << "Press enter when ready for next repetition: " << std::flush;
-            std::string dummy;
-            getline(std::cin, dummy);
-        }
-    } while (opts.pause);
+        reporter.reset();
+        const live_totals totals = t.get_live();
+        const transmit_stats stats = t.get_stats() - start_stats;
+        show_summary(totals - start_live, start, stop, stats, opts);
+        publish_summary(metrics, totals, totals - start_live, start, stop, stats);
+        wait_for_user(opts);
+    } while (opts.pause && !interrupted());
+}
+
+template<typename Transmit>
+static void run_transmit(Transmit &t, callback_data &data, const options &opts,
+                         metrics_exporter &metrics)
+{
+    if (opts.stream)
+        run_stream(t, data, opts, metrics);
+    else
+        run_loaded(t, data, opts, metrics);
+}
+
+template<typename Transmit>
+static void run(const options &opts)
+{
+    boost::asio::io_service io_service;
+
+    callback_data data;
+    // With a profile, rate_transmit works out the send times instead
+    if (opts.mbps != 0 && opts.profile.empty())
+        data.per_byte = std::chrono::duration<double, std::micro>(8.0 / opts.mbps);
+    if (opts.pps != 0 && opts.profile.empty())
+        data.per_packet = std::chrono::duration<double>(1.0 / opts.pps);
+    data.use_timestamps = opts.use_timestamps;
+    data.speed = opts.speed;
+    if (opts.max_gap != std::numeric_limits<double>::infinity())
+        data.max_gap = std::chrono::duration_cast<duration>(std::chrono::duration<double>(opts.max_gap));
+    data.use_destination = opts.use_destination;
+    data.fragments = std::make_shared<reassembler>(
+        opts.reassembly_slots,
+        std::chrono::duration_cast<reassembler::time_type>(
+            std::chrono::duration<double>(opts.reassembly_timeout)));
+    if (!opts.use_destination)
+    {
+        udp::resolver resolver(io_service);
+        udp::resolver::query query(udp::v4(), opts.host, opts.port);
+        data.destination = *resolver.resolve(query);
+    }
+    metrics_exporter metrics("udpreplay", opts.metrics_json, opts.metrics_listen);
+
+    if (opts.threads > 1)
+    {
+        sharded_transmit<Transmit> t(opts, io_service);
+        run_transmit(t, data, opts, metrics);
+    }
+    else
+    {
+        Transmit t(opts, io_service);
+        run_transmit(t, data, opts, metrics);
+    }
 }
 
 static options parse_args(int argc, char **argv)
@@ -288,28 +1102,64 @@ static options parse_args(int argc, char **argv)
     options out;
 
     po::positional_options_description positional;
-    positional.add("input-file", 1);
+    positional.add("input-file", -1);
 
     po::options_description desc;
     desc.add_options()
         ("pps", po::value<double>(&out.pps), "packets per second (0 for max speed)")
         ("mbps", po::value<double>(&out.mbps), "bits per second (0 for max speed)")
         ("use-timestamps", po::bool_switch(&out.use_timestamps)->default_value(defaults.use_timestamps), "use timestamps from the file for replay timing")
+        ("spin-threshold", po::value<double>(&out.spin_threshold)->default_value(defaults.spin_threshold), "microseconds before a send time at which to stop sleeping and spin")
+        ("pacing-quantum", po::value<double>(&out.pacing_quantum)->default_value(defaults.pacing_quantum), "microseconds of send times to combine into one batch when rate limiting")
+        ("profile", po::value<std::string>(&out.profile), "rate multiplier over time for --pps or --mbps (or @file to read it from a file)")
+        ("speed", po::value<double>(&out.speed)->default_value(defaults.speed), "playback speed relative to the capture, with --use-timestamps")
+        ("max-gap", po::value<double>(&out.max_gap), "seconds to which to shorten longer idle periods, with --use-timestamps")
+        ("late-policy", po::value<std::string>(&out.late_policy)->default_value(defaults.late_policy), "what to do when behind schedule (burst/shift/drop/cap)")
+        ("late-threshold", po::value<double>(&out.late_threshold)->default_value(defaults.late_threshold), "microseconds behind schedule at which --late-policy applies")
+        ("catch-up-rate", po::value<double>(&out.catch_up_rate)->default_value(defaults.catch_up_rate), "multiple of the nominal rate at which to catch up with --late-policy=cap")
         ("use-destination", po::bool_switch(&out.use_destination)->default_value(defaults.use_destination), "use original destination endpoints from the file")
         ("host", po::value<std::string>(&out.host)->default_value(defaults.host), "destination host")
         ("port", po::value<std::string>(&out.port)->default_value(defaults.port), "destination port")
         ("bind", po::value<std::string>(&out.bind)->default_value(defaults.bind), "local address (for multicast)")
-        ("mode", po::value<std::string>(&out.mode)->default_value(defaults.mode), "transmit mode (asio/sendmmsg/ibv)")
+        ("mode", po::value<std::string>(&out.mode)->default_value(defaults.mode), "transmit mode (asio/sendmmsg/gso/ibv/uring/pfpacket/xdp)")
+        ("batch-size", po::value<std::size_t>(&out.batch_size)->default_value(defaults.batch_size), "packets per system call in sendmmsg mode (0 for default)")
+        ("connect-limit", po::value<std::size_t>(&out.connect_limit)->default_value(defaults.connect_limit), "maximum destinations to use connected sockets for with --use-destination in asio and sendmmsg modes")
+        ("zerocopy", po::bool_switch(&out.zerocopy)->default_value(defaults.zerocopy), "send without copying in sendmmsg, gso and xdp modes")
+        ("txtime", po::bool_switch(&out.txtime)->default_value(defaults.txtime), "schedule packets with SO_TXTIME in sendmmsg mode, so that the qdisc paces them")
+        ("txtime-clock", po::value<std::string>(&out.txtime_clock)->default_value(defaults.txtime_clock), "clock for --txtime (monotonic for fq, tai for etf)")
+        ("metrics-json", po::value<std::string>(&out.metrics_json), "file to append metrics to as JSON lines (- for stdout)")
+        ("metrics-listen", po::value<std::string>(&out.metrics_listen), "serve Prometheus metrics on [HOST:]PORT or unix:PATH")
+        ("stats-interval", po::value<double>(&out.stats_interval), "seconds between progress reports while transmitting (default 1 with --repeat=0, otherwise none)")
+        ("tx-timestamps", po::bool_switch(&out.tx_timestamps)->default_value(defaults.tx_timestamps), "measure timing with kernel transmit timestamps in sendmmsg mode")
+        ("uring-sqpoll", po::bool_switch(&out.uring_sqpoll)->default_value(defaults.uring_sqpoll), "use a kernel thread to poll for submissions in uring mode")
+        ("qdisc-bypass", po::bool_switch(&out.qdisc_bypass)->default_value(defaults.qdisc_bypass), "send directly to the device queue in pfpacket mode")
+        ("xdp-queue", po::value<unsigned int>(&out.xdp_queue)->default_value(defaults.xdp_queue), "NIC queue to bind to in xdp mode")
         ("buffer-size", po::value<size_t>(&out.buffer_size)->default_value(defaults.buffer_size), "transmit buffer size (0 for system default)")
         ("ttl", po::value<uint8_t>(&out.ttl)->default_value(defaults.ttl), "TTL for multicast (0 for system default)")
         ("repeat", po::value<size_t>(&out.repeat), "send the data this many times")
         ("addresses", po::value<int>(&out.addresses)->default_value(defaults.addresses), "number of sequential addresses to use with generator")
         ("pause", po::bool_switch(&out.pause)->default_value(defaults.pause), "after completion, wait for user input then send again")
+        ("mmap", po::bool_switch(&out.mmap)->default_value(defaults.mmap), "memory-map the capture instead of copying the payloads")
+        ("reassembly-slots", po::value<std::size_t>(&out.reassembly_slots)->default_value(defaults.reassembly_slots), "maximum number of fragmented datagrams in progress")
+        ("reassembly-timeout", po::value<double>(&out.reassembly_timeout)->default_value(defaults.reassembly_timeout), "seconds (of capture time) to wait for all fragments of a datagram")
+        ("threads", po::value<int>(&out.threads)->default_value(defaults.threads), "number of threads for transmission")
+        ("affinity", po::bool_switch(&out.affinity)->default_value(defaults.affinity), "pin transmission threads to CPUs")
+        ("shard", po::value<std::string>(&out.shard)->default_value(defaults.shard), "how to divide packets between threads (flow/round-robin)")
+        ("load-threads", po::value<int>(&out.load_threads)->default_value(defaults.load_threads), "number of threads for loading the capture (0 for auto)")
+        ("cache", po::value<std::string>(&out.cache_file), "replay cache file to use, built if missing or out of date")
+        ("stream", po::bool_switch(&out.stream)->default_value(defaults.stream), "load the capture in the background while transmitting")
+        ("stream-batch", po::value<std::size_t>(&out.stream_batch)->default_value(defaults.stream_batch), "packets per batch in streaming mode")
+        ("stream-depth", po::value<std::size_t>(&out.stream_depth)->default_value(defaults.stream_depth), "number of batches to load ahead in streaming mode")
+        ("filter", po::value<std::string>(&out.filter), "BPF expression selecting the packets to replay")
+        ("start-index", po::value<std::uint64_t>(&out.start_index), "index of the first frame of the capture to load (counting from 0)")
+        ("end-index", po::value<std::uint64_t>(&out.end_index), "index of the frame of the capture at which to stop loading")
+        ("start-time", po::value<double>(&out.start_time), "seconds after the start of the capture at which to start loading")
+        ("end-time", po::value<double>(&out.end_time), "seconds after the start of the capture at which to stop loading")
         ;
 
     po::options_description hidden;
     hidden.add_options()
-        ("input-file", po::value<std::string>(&out.input_file)->required());
+        ("input-file", po::value<std::vector<std::string>>(&out.input_files)->required());
 
     po::options_description all;
     all.add(desc);
@@ -329,8 +1179,10 @@ static options parse_args(int argc, char **argv)
         try
         {
             // See if we were given a packet size instead of a file
-            out.packet_size = boost::lexical_cast<int>(out.input_file);
-            out.input_file = "";
+            out.packet_size = boost::lexical_cast<int>(out.input_files[0]);
+            if (out.input_files.size() > 1)
+                throw po::error("Cannot specify more than one packet size");
+            out.input_files.clear();
             if (out.packet_size <= 0)
                 throw po::error("Packet size must be positive");
             if (out.use_timestamps)
@@ -339,6 +1191,16 @@ static options parse_args(int argc, char **argv)
                 throw po::error("Cannot use --use-destination with packet generator");
             if (out.addresses < 1)
                 throw po::error("Value of --addresses cannot be less than 1");
+            if (out.stream)
+                throw po::error("Cannot use --stream with packet generator");
+            if (out.mmap)
+                throw po::error("Cannot use --mmap with packet generator");
+            if (!out.cache_file.empty())
+                throw po::error("Cannot use --cache with packet generator");
+            if (out.load_threads != 1)
+                throw po::error("Cannot use --load-threads with packet generator");
+            if (vm.count("filter") || has_range(out))
+                throw po::error("Cannot use --filter or a frame range with packet generator");
             if (!vm.count("repeat"))
                 out.repeat = 0;   // run forever
         }
@@ -347,60 +1209,174 @@ static options parse_args(int argc, char **argv)
             // It's a filename
             if (out.addresses != 1)
                 throw po::error("Cannot use --addresses with a capture file");
+            if (out.input_files.size() > 1 && out.load_threads != 1)
+                throw po::error("Cannot use --load-threads with multiple capture files");
+        }
+        if (out.zerocopy && out.mode != "sendmmsg" && out.mode != "gso" && out.mode != "xdp")
+            throw po::error("--zerocopy is only supported with --mode=sendmmsg, --mode=gso and --mode=xdp");
+        if (out.batch_size != 0 && out.mode != "sendmmsg")
+            throw po::error("--batch-size is only supported with --mode=sendmmsg");
+        if (out.batch_size > UIO_MAXIOV)
+            throw po::error("Value of --batch-size cannot exceed " + std::to_string(UIO_MAXIOV));
+        if (!out.profile.empty())
+        {
+            if (out.profile[0] == '@')
+            {
+                std::ifstream in(out.profile.substr(1));
+                std::ostringstream contents;
+                if (!(in >> contents.rdbuf()))
+                    throw po::error("Could not read profile from " + out.profile.substr(1));
+                out.profile = contents.str();
+            }
+            try
+            {
+                rate_profile check(out.profile);
+            }
+            catch (std::invalid_argument &e)
+            {
+                throw po::error(std::string("Invalid --profile: ") + e.what());
+            }
+            if (out.pps == 0 && out.mbps == 0)
+                throw po::error("--profile requires --pps or --mbps");
+            if (out.txtime)
+                throw po::error("Cannot use --profile with --txtime");
         }
+        if (out.speed <= 0)
+            throw po::error("Value of --speed must be positive");
+        if (out.max_gap < 0)
+            throw po::error("Value of --max-gap cannot be negative");
+        if ((vm.count("speed") && !vm["speed"].defaulted()) || vm.count("max-gap"))
+        {
+            if (!out.use_timestamps)
+                throw po::error("--speed and --max-gap require --use-timestamps");
+        }
+        if (out.late_policy != "burst" && out.late_policy != "shift"
+            && out.late_policy != "drop" && out.late_policy != "cap")
+            throw po::error("Value of --late-policy must be burst, shift, drop or cap");
+        if (out.late_policy != "burst")
+        {
+            if (out.pps == 0 && out.mbps == 0 && !out.use_timestamps)
+                throw po::error("--late-policy requires --pps, --mbps or --use-timestamps");
+            if (out.txtime)
+                throw po::error("Cannot use --late-policy with --txtime");
+        }
+        if (out.late_threshold < 0)
+            throw po::error("Value of --late-threshold cannot be negative");
+        if (out.catch_up_rate <= 1)
+            throw po::error("Value of --catch-up-rate must be greater than 1");
+        if (out.stats_interval < 0)
+            throw po::error("Value of --stats-interval cannot be negative");
+        if (!vm.count("stats-interval") && out.repeat == 0)
+            out.stats_interval = 1;     // otherwise nothing is printed until interrupted
+        if (out.spin_threshold < 0)
+            throw po::error("Value of --spin-threshold cannot be negative");
+        if (out.pacing_quantum < 0)
+            throw po::error("Value of --pacing-quantum cannot be negative");
+        if (out.txtime && out.mode != "sendmmsg")
+            throw po::error("--txtime is only supported with --mode=sendmmsg");
+        if (out.txtime && out.pps == 0 && out.mbps == 0 && !out.use_timestamps)
+            throw po::error("--txtime requires --pps, --mbps or --use-timestamps");
+        if (out.txtime_clock != "monotonic" && out.txtime_clock != "tai")
+            throw po::error("Value of --txtime-clock must be monotonic or tai");
+        if (out.tx_timestamps)
+        {
+            if (out.mode != "sendmmsg")
+                throw po::error("--tx-timestamps is only supported with --mode=sendmmsg");
+            if (out.pps == 0 && out.mbps == 0 && !out.use_timestamps)
+                throw po::error("--tx-timestamps requires --pps, --mbps or --use-timestamps");
+            if (out.zerocopy)
+                throw po::error("Cannot use --tx-timestamps with --zerocopy");
+            if (!out.profile.empty())
+                throw po::error("Cannot use --tx-timestamps with --profile");
+        }
+        if (out.qdisc_bypass && out.mode != "pfpacket")
+            throw po::error("--qdisc-bypass is only supported with --mode=pfpacket");
         if (out.repeat == 0 && out.pause)
             throw po::error("Cannot use --repeat=0 with --pause");
+        if (out.stream && out.mmap)
+            throw po::error("Cannot use --stream with --mmap");
+        if (out.stream && !out.cache_file.empty())
+            throw po::error("Cannot use --stream with --cache");
+        if (out.stream && out.load_threads != 1)
+            throw po::error("Cannot use --stream with --load-threads");
+        if (out.threads < 1)
+            throw po::error("Value of --threads must be positive");
+        if (out.shard != "flow" && out.shard != "round-robin")
+            throw po::error("Value of --shard must be flow or round-robin");
+        // Flows need not be spread evenly, so the shares of the rate are unknown
+        if (!out.profile.empty() && out.threads > 1 && out.shard == "flow")
+            throw po::error("Cannot use --profile with --threads and --shard=flow (use --shard=round-robin)");
+        if (out.load_threads < 0)
+            throw po::error("Value of --load-threads cannot be negative");
+        if (out.start_time < 0 || out.end_time < 0)
+            throw po::error("Values of --start-time and --end-time cannot be negative");
+        if (out.end_index <= out.start_index || out.end_time <= out.start_time)
+            throw po::error("End of the frame range must be after the start");
+        if (out.reassembly_slots == 0)
+            throw po::error("Value of --reassembly-slots must be positive");
+        if (out.stream_batch == 0 || out.stream_depth == 0)
+            throw po::error("Values of --stream-batch and --stream-depth must be positive");
         return out;
     }
     catch (po::error &e)
     {
         std::cerr << e.what() << "\n\n";
-        std::cerr << "Usage: udpreplay [options] capturefile|packet-size\n";
+        std::cerr << "Usage: udpreplay [options] capturefile...|packet-size\n";
         std::cerr << desc;
         throw;
     }
 }
 
-std::shared_ptr<pcap_t> open_capture(const options &opts)
-{
-    char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_t *p = pcap_open_offline_with_tstamp_precision(
-        opts.input_file.c_str(), PCAP_TSTAMP_PRECISION_NANO, errbuf);
-    if (p == NULL)
-    {
-        throw std::runtime_error(errbuf);
-    }
-    return std::shared_ptr<pcap_t>(p, pcap_close);
-}
-
 int main(int argc, char **argv)
 {
     try
     {
         options opts = parse_args(argc, argv);
-        std::shared_ptr<pcap_t> p;
-        if (opts.packet_size == 0)
-        {
-            p = open_capture(opts);
-            prepare(p.get());
-        }
 #if HAVE_SENDMMSG
         if (opts.mode == "sendmmsg")
         {
-            run<rate_transmit<sendmmsg_transmit>>(p.get(), opts);
+            run<rate_transmit<sendmmsg_transmit>>(opts);
+        }
+        else
+#endif
+#if HAVE_SENDMMSG && HAVE_DECL_UDP_SEGMENT
+        if (opts.mode == "gso")
+        {
+            run<rate_transmit<gso_transmit>>(opts);
         }
         else
 #endif
 #if HAVE_IBV
         if (opts.mode == "ibv")
         {
-            run<rate_transmit<ibv_transmit>>(p.get(), opts);
+            run<rate_transmit<ibv_transmit>>(opts);
+        }
+        else
+#endif
+#if HAVE_LINUX_IO_URING_H
+        if (opts.mode == "uring")
+        {
+            run<rate_transmit<uring_transmit>>(opts);
+        }
+        else
+#endif
+#if HAVE_LINUX_IF_PACKET_H
+        if (opts.mode == "pfpacket")
+        {
+            run<rate_transmit<pfpacket_transmit>>(opts);
+        }
+        else
+#endif
+#if HAVE_DECL_XDP_UMEM_UNALIGNED_CHUNK_FLAG
+        if (opts.mode == "xdp")
+        {
+            run<rate_transmit<xdp_transmit>>(opts);
         }
         else
 #endif
         if (opts.mode == "asio")
         {
-            run<rate_transmit<asio_transmit>>(p.get(), opts);
+            run<rate_transmit<asio_transmit>>(opts);
         }
         else
         {
@@ -0,0 +1,313 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <algorithm>
+#include <system_error>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include "uring_transmit.h"
+
+using boost::asio::ip::udp;
+
+uring::uring(unsigned entries, bool sqpoll) : sqpoll(sqpoll)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    if (sqpoll)
+    {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;   // milliseconds
+    }
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_setup failed");
+
+    try
+    {
+        auto map = [this](mapping &m, std::size_t size, off_t offset)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, offset);
+            if (ptr == MAP_FAILED)
+                throw std::system_error(errno, std::system_category(), "mmap failed");
+            m.ptr = ptr;
+            m.size = size;
+        };
+
+        std::size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        std::size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        std::uint8_t *sq_ptr, *cq_ptr;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            map(sq_map, std::max(sq_size, cq_size), IORING_OFF_SQ_RING);
+            sq_ptr = cq_ptr = (std::uint8_t *) sq_map.ptr;
+        }
+        else
+        {
+            map(sq_map, sq_size, IORING_OFF_SQ_RING);
+            map(cq_map, cq_size, IORING_OFF_CQ_RING);
+            sq_ptr = (std::uint8_t *) sq_map.ptr;
+            cq_ptr = (std::uint8_t *) cq_map.ptr;
+        }
+        map(sqe_map, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+
+        sq_head = (unsigned *) (sq_ptr + params.sq_off.head);
+        sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+        sq_mask = (unsigned *) (sq_ptr + params.sq_off.ring_mask);
+        sq_flags = (unsigned *) (sq_ptr + params.sq_off.flags);
+        sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+        cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+        cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+        cq_mask = (unsigned *) (cq_ptr + params.cq_off.ring_mask);
+        sqes = (io_uring_sqe *) sqe_map.ptr;
+        cqes = (io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+        sq_local_tail = *sq_tail;
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+}
+
+void uring::release()
+{
+    for (mapping *m : {&sqe_map, &cq_map, &sq_map})
+        if (m->ptr)
+            munmap(m->ptr, m->size);
+    close(fd);
+}
+
+uring::~uring()
+{
+    release();
+}
+
+io_uring_sqe &uring::get_sqe()
+{
+    unsigned index = sq_local_tail & *sq_mask;
+    io_uring_sqe &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sq_array[index] = index;
+    sq_local_tail++;
+    to_submit++;
+    return sqe;
+}
+
+unsigned uring::submit(unsigned min_complete)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned n = to_submit;
+    unsigned enter_submit = n;
+    unsigned flags = 0;
+    if (sqpoll)
+    {
+        // The kernel thread picks up the SQEs itself, but may need waking
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        enter_submit = 0;
+        if (n > 0 && (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP))
+            flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    if (min_complete > 0)
+        flags |= IORING_ENTER_GETEVENTS;
+    to_submit = 0;
+    if (enter_submit == 0 && flags == 0)
+        return n;
+
+    long ret;
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, fd, enter_submit, min_complete, flags, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+        throw std::system_error(errno, std::system_category(), "io_uring_enter failed");
+    if (!sqpoll && ret < enter_submit)
+    {
+        // The rest remain in the submission queue for next time
+        to_submit = enter_submit - ret;
+        n = ret;
+    }
+    return n;
+}
+
+bool uring::peek_cqe(io_uring_cqe &cqe)
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+uring_transmit::uring_transmit(const options &opts, boost::asio::io_service &io_service)
+    : slot_storage(depth), socket(io_service), ring(2 * depth, opts.uring_sqpoll)
+{
+    socket.open(udp::v4());
+    socket.non_blocking(true);
+    set_buffer_size(socket, opts.buffer_size);
+    set_ttl(socket, opts.ttl);
+    fd = socket.native_handle();
+    for (int i = depth - 1; i >= 0; i--)
+        free_slots.push_back(i);
+}
+
+uring_transmit::~uring_transmit()
+{
+    try
+    {
+        flush();
+    }
+    catch (std::exception &e)
+    {
+        // Only happens if sending has already failed
+    }
+}
+
+void uring_transmit::submit(unsigned min_complete)
+{
+    unsigned n = ring.submit(min_complete);
+    if (n > 0)
+    {
+        stats.uring_submissions++;
+        stats.uring_sqes += n;
+    }
+}
+
+void uring_transmit::add_send(std::uint32_t id)
+{
+    io_uring_sqe &sqe = ring.get_sqe();
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = fd;
+    sqe.addr = (std::uintptr_t) &slot_storage[id].msg;
+    sqe.len = 1;
+    sqe.user_data = id;
+}
+
+void uring_transmit::add_retries()
+{
+    for (std::uint32_t id : retry_slots)
+    {
+        io_uring_sqe &poll = ring.get_sqe();
+        poll.opcode = IORING_OP_POLL_ADD;
+        poll.fd = fd;
+        poll.poll_events = POLLOUT;
+        poll.flags = IOSQE_IO_LINK;
+        poll.user_data = poll_tag;
+        add_send(id);
+    }
+    retry_slots.clear();
+}
+
+void uring_transmit::reap(std::size_t min_slots)
+{
+    while (true)
+    {
+        io_uring_cqe cqe;
+        std::size_t n = 0;
+        while (ring.peek_cqe(cqe))
+        {
+            if (cqe.user_data == poll_tag)
+            {
+                // On failure, the linked send completes with -ECANCELED
+                if (cqe.res < 0)
+                    throw std::system_error(-cqe.res, std::system_category(), "poll failed");
+                continue;
+            }
+            n++;
+            if (cqe.res == -EAGAIN)
+            {
+                // The socket is non-blocking, so a full buffer is left to us
+                retry_slots.push_back(cqe.user_data);
+                stats.retries++;
+                continue;
+            }
+            if (cqe.res < 0)
+                throw std::system_error(-cqe.res, std::system_category(), "sendmsg failed");
+            if (std::size_t(cqe.res) != slot_storage[cqe.user_data].iov.iov_len)
+                throw std::runtime_error("short write");
+            free_slots.push_back(cqe.user_data);
+        }
+        if (n > 0)
+        {
+            stats.uring_reaps++;
+            stats.uring_cqes += n;
+        }
+        add_retries();
+        if (free_slots.size() >= min_slots)
+        {
+            submit(0);
+            return;
+        }
+        submit(1);
+    }
+}
+
+void uring_transmit::send_packets(std::size_t first, std::size_t last,
+                                  time_point start)
+{
+    (void) start; // unused
+    for (std::size_t i = first; i < last; i++)
+    {
+        if (free_slots.empty())
+        {
+            auto wait_start = std::chrono::high_resolution_clock::now();
+            reap(1);
+            stats.stalls++;
+            stats.blocked += std::chrono::high_resolution_clock::now() - wait_start;
+        }
+        std::uint32_t id = free_slots.back();
+        free_slots.pop_back();
+
+        packet pkt = collector.get_packet(i);
+        slot &s = slot_storage[id];
+        std::memset(&s, 0, sizeof(s));
+        s.addr.sin_family = AF_INET;
+        s.addr.sin_addr.s_addr = pkt.dst_host;
+        s.addr.sin_port = pkt.dst_port;
+        s.iov.iov_base = const_cast<std::uint8_t *>(pkt.data);
+        s.iov.iov_len = pkt.len;
+        s.msg.msg_name = &s.addr;
+        s.msg.msg_namelen = sizeof(s.addr);
+        s.msg.msg_iov = &s.iov;
+        s.msg.msg_iovlen = 1;
+        add_send(id);
+    }
+    submit(0);
+    reap(0);
+}
+
+void uring_transmit::flush()
+{
+    submit(0);
+    reap(depth);
+}
+
+constexpr int uring_transmit::depth;
+constexpr int uring_transmit::batch_size;
+constexpr std::uint64_t uring_transmit::poll_tag;
+
+#endif // HAVE_LINUX_IO_URING_H
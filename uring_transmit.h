@@ -0,0 +1,131 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_URING_TRANSMIT_H
+#define UDPREPLAY_URING_TRANSMIT_H
+
+#include <config.h>
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include "common.h"
+
+/* Minimal io_uring instance, set up directly with the system calls so that
+ * liburing is not required.
+ */
+class uring : public boost::noncopyable
+{
+private:
+    struct mapping
+    {
+        void *ptr = nullptr;
+        std::size_t size = 0;
+    };
+
+    int fd = -1;
+    bool sqpoll;
+    mapping sq_map, cq_map, sqe_map;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    unsigned sq_local_tail;    // includes SQEs not yet made visible to the kernel
+    unsigned to_submit = 0;
+
+    void release();
+
+public:
+    /// @param entries  Number of submission queue entries (a power of 2)
+    uring(unsigned entries, bool sqpoll);
+    ~uring();
+
+    /// Get a zeroed SQE to fill in. The caller must ensure there is space.
+    io_uring_sqe &get_sqe();
+    /**
+     * Pass the SQEs obtained from @ref get_sqe to the kernel, and wait until
+     * at least @a min_complete completions are available. Returns the number
+     * of SQEs submitted.
+     */
+    unsigned submit(unsigned min_complete);
+    /// Fetch a completion, returning false if there are none available
+    bool peek_cqe(io_uring_cqe &cqe);
+};
+
+class uring_transmit
+{
+public:
+    static constexpr int depth = 256;
+    static constexpr int batch_size = 32;
+
+private:
+    /// Per-request state, which must remain valid until its completion
+    struct slot
+    {
+        msghdr msg;
+        iovec iov;
+        sockaddr_in addr;
+    };
+
+    /// user_data of the polls that precede resubmitted sends
+    static constexpr std::uint64_t poll_tag = ~std::uint64_t(0);
+
+    basic_collector collector;
+    std::vector<slot> slot_storage;
+    std::vector<std::uint32_t> free_slots;
+    std::vector<std::uint32_t> retry_slots;   // sends that found the socket buffer full
+    boost::asio::ip::udp::socket socket;
+    int fd;
+    /* Declared last of these, so that it is destroyed before the memory its
+     * requests use. The submission queue holds 2 * depth entries, enough
+     * for every slot to be a retry (a poll and a send) that the kernel has
+     * not yet picked up, so that get_sqe never needs to check for space.
+     */
+    uring ring;
+
+    transmit_stats stats;
+
+    void submit(unsigned min_complete);
+    /// Queue the send for a slot, which must already be filled in
+    void add_send(std::uint32_t id);
+    /**
+     * Resubmit the sends in @ref retry_slots, each linked behind a poll
+     * that waits for the socket to be writable.
+     */
+    void add_retries();
+    void reap(std::size_t min_slots);
+
+public:
+    typedef basic_collector collector_type;
+
+    uring_transmit(const options &opts, boost::asio::io_service &io_service);
+    ~uring_transmit();
+
+    collector_type &get_collector() { return collector; }
+    void send_packets(std::size_t first, std::size_t last, time_point start);
+    void flush();
+    const transmit_stats &get_stats() const { return stats; }
+};
+
+#endif // HAVE_LINUX_IO_URING_H
+#endif // UDPREPLAY_URING_TRANSMIT_H
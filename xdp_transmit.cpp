@@ -0,0 +1,370 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_DECL_XDP_UMEM_UNALIGNED_CHUNK_FLAG
+
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/ethernet.h>
+#include "xdp_transmit.h"
+
+using boost::asio::ip::udp;
+
+xdp_collector::xdp_collector(
+    const frame_builder &builder, std::shared_ptr<mac_resolver> resolver,
+    std::size_t max_frame, std::size_t reserve)
+    : builder(builder), resolver(std::move(resolver)), max_frame(max_frame),
+    page_size(sysconf(_SC_PAGESIZE))
+{
+    capacity = std::max(reserve, std::size_t(1024 * 1024));
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+    void *ptr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "mmap failed");
+    area = (std::uint8_t *) ptr;
+}
+
+xdp_collector::~xdp_collector()
+{
+    munmap(area, capacity);
+}
+
+std::uint64_t xdp_collector::allocate(std::size_t len)
+{
+    // Frames must not cross a page boundary, since pages need not be contiguous
+    if (used / page_size != (used + len - 1) / page_size)
+        used = (used + page_size - 1) / page_size * page_size;
+    if (used + len > capacity)
+    {
+        if (fixed)
+            throw std::runtime_error("frames do not fit in the memory registered for --mode=xdp");
+        std::size_t new_capacity = capacity * 2;
+        void *ptr = mremap(area, capacity, new_capacity, MREMAP_MAYMOVE);
+        if (ptr == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "mremap failed");
+        area = (std::uint8_t *) ptr;
+        capacity = new_capacity;
+    }
+    std::uint64_t addr = used;
+    used += len;
+    return addr;
+}
+
+void xdp_collector::add_packet(const packet &pkt)
+{
+    std::size_t len = pkt.len + frame_builder::header_size;
+    if (len > max_frame)
+        throw std::runtime_error(
+            "packet of " + std::to_string(pkt.len)
+            + " bytes exceeds the MTU (--mode=xdp cannot fragment)");
+    if (len > page_size)
+        throw std::runtime_error(
+            "packet of " + std::to_string(pkt.len) + " bytes does not fit in a "
+            + std::to_string(page_size) + "-byte frame buffer (--mode=xdp is limited to one page per frame)");
+    std::uint64_t addr = allocate(len);
+    builder.build(area + addr, pkt, (*resolver)(pkt.dst_host));
+    frames.push_back(frame{addr, std::uint32_t(len), pkt.timestamp});
+    total_bytes += pkt.len;
+}
+
+std::size_t xdp_collector::num_packets() const
+{
+    return frames.size();
+}
+
+std::size_t xdp_collector::packet_size(std::size_t idx) const
+{
+    return frames[idx].len - frame_builder::header_size;
+}
+
+duration xdp_collector::packet_timestamp(std::size_t idx) const
+{
+    return frames[idx].timestamp;
+}
+
+std::size_t xdp_collector::bytes() const
+{
+    return total_bytes;
+}
+
+void xdp_collector::clear()
+{
+    frames.clear();
+    used = 0;
+    total_bytes = 0;
+}
+
+std::unique_ptr<xdp_collector> xdp_collector::clone_empty() const
+{
+    return std::unique_ptr<xdp_collector>(new xdp_collector(builder, resolver, max_frame));
+}
+
+void xdp_collector::append(xdp_collector &&other)
+{
+    frames.reserve(frames.size() + other.frames.size());
+    for (const frame &f : other.frames)
+    {
+        std::uint64_t addr = allocate(f.len);
+        std::memcpy(area + addr, other.area + f.addr, f.len);
+        frames.push_back(frame{addr, f.len, f.timestamp});
+    }
+    total_bytes += other.total_bytes;
+    other.clear();
+}
+
+std::uint8_t *xdp_collector::fix(std::size_t &size)
+{
+    fixed = true;
+    size = capacity;
+    return area;
+}
+
+xdp_desc xdp_collector::get_desc(std::size_t idx) const
+{
+    xdp_desc desc = {};
+    desc.addr = frames[idx].addr;
+    desc.len = frames[idx].len;
+    return desc;
+}
+
+
+xdp_transmit::xdp_transmit(const options &opts, boost::asio::io_service &io_service)
+    : socket(io_service, udp::v4()), queue(opts.xdp_queue), require_zerocopy(opts.zerocopy)
+{
+    if (opts.bind == "")
+        throw std::runtime_error("--bind must be specified with --mode=xdp");
+    auto src_address = boost::asio::ip::address::from_string(opts.bind);
+    if (!src_address.is_v4())
+        throw std::runtime_error("--mode=xdp only supports IPv4");
+    udp::endpoint src_endpoint(src_address, 0);
+    // Get the OS to assign us a source port
+    socket.bind(src_endpoint);
+    src_endpoint = socket.local_endpoint();
+    interface_info iface = get_interface(src_address);
+    ifindex = iface.index;
+
+    /* The UMEM is registered with a chunk size of one page, which further
+     * limits the frame size (checked by the collector). When streaming, the
+     * collector is refilled for each batch after registration, so space for
+     * a full batch is reserved.
+     */
+    std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t max_frame = iface.mtu + sizeof(ether_header);
+    std::size_t reserve = opts.stream ? opts.stream_batch * page_size : 0;
+    frame_builder builder(src_endpoint, iface.mac, opts.ttl);
+    std::shared_ptr<mac_resolver> resolver = std::make_shared<mac_resolver>(iface);
+    collector.reset(new xdp_collector(builder, resolver, max_frame, reserve));
+
+    // Created now so that a lack of privileges is reported before loading
+    fd = ::socket(AF_XDP, SOCK_RAW, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "socket(AF_XDP) failed");
+}
+
+xdp_transmit::~xdp_transmit()
+{
+    if (bound)
+    {
+        try
+        {
+            flush();
+        }
+        catch (std::exception &e)
+        {
+            // Only happens if sending has already failed
+        }
+        reap_invalid();
+        if (invalid > 0)
+            std::cerr << "AF_XDP: " << invalid << " frames rejected by the kernel\n";
+    }
+    if (tx.map)
+        munmap(tx.map, tx.map_size);
+    if (cq.map)
+        munmap(cq.map, cq.map_size);
+    close(fd);
+}
+
+template<typename T>
+static void map_ring(int fd, xdp_ring<T> &ring, const xdp_ring_offset &ring_off, off_t offset)
+{
+    std::size_t map_size = ring_off.desc + xdp_transmit::ring_size * sizeof(T);
+    void *ptr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (ptr == MAP_FAILED)
+        throw std::system_error(errno, std::system_category(), "mmap failed");
+    std::uint8_t *base = (std::uint8_t *) ptr;
+    ring.map = ptr;
+    ring.map_size = map_size;
+    ring.producer = (std::uint32_t *) (base + ring_off.producer);
+    ring.consumer = (std::uint32_t *) (base + ring_off.consumer);
+    ring.flags = (std::uint32_t *) (base + ring_off.flags);
+    ring.entries = (T *) (base + ring_off.desc);
+}
+
+void xdp_transmit::bind()
+{
+    auto set = [this](int optname, const void *value, socklen_t len, const char *name)
+    {
+        if (setsockopt(fd, SOL_XDP, optname, value, len) < 0)
+            throw std::system_error(errno, std::system_category(),
+                                    std::string("setsockopt(") + name + ") failed");
+    };
+
+    std::size_t size;
+    std::uint8_t *area = collector->fix(size);
+    xdp_umem_reg reg = {};
+    reg.addr = (std::uintptr_t) area;
+    reg.len = size;
+    reg.chunk_size = sysconf(_SC_PAGESIZE);
+    reg.flags = XDP_UMEM_UNALIGNED_CHUNK_FLAG;
+    set(XDP_UMEM_REG, &reg, sizeof(reg), "XDP_UMEM_REG");
+    /* Nothing is received, but the kernel requires a fill ring. The
+     * completion ring is as large as the TX ring, so that it can never
+     * overflow.
+     */
+    std::uint32_t fill_size = 1;
+    std::uint32_t entries = ring_size;
+    set(XDP_UMEM_FILL_RING, &fill_size, sizeof(fill_size), "XDP_UMEM_FILL_RING");
+    set(XDP_UMEM_COMPLETION_RING, &entries, sizeof(entries), "XDP_UMEM_COMPLETION_RING");
+    set(XDP_TX_RING, &entries, sizeof(entries), "XDP_TX_RING");
+
+    xdp_mmap_offsets off;
+    socklen_t len = sizeof(off);
+    if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+        throw std::system_error(errno, std::system_category(), "getsockopt(XDP_MMAP_OFFSETS) failed");
+
+    map_ring(fd, tx, off.tx, XDP_PGOFF_TX_RING);
+    map_ring(fd, cq, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING);
+    tx_producer = *tx.producer;
+
+    sockaddr_xdp addr = {};
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP | (require_zerocopy ? XDP_ZEROCOPY : 0);
+    if (::bind(fd, (const sockaddr *) &addr, sizeof(addr)) < 0)
+    {
+        if (errno == EOPNOTSUPP && require_zerocopy)
+            throw std::runtime_error("the driver does not support zero-copy AF_XDP (omit --zerocopy)");
+        throw std::system_error(errno, std::system_category(), "bind(AF_XDP) failed");
+    }
+    bound = true;
+
+    xdp_options options = {};
+    len = sizeof(options);
+    if (getsockopt(fd, SOL_XDP, XDP_OPTIONS, &options, &len) == 0)
+        zerocopy = options.flags & XDP_OPTIONS_ZEROCOPY;
+    std::cout << "AF_XDP: using " << (zerocopy ? "zero-copy" : "copy") << " mode on queue "
+        << queue << std::endl;
+}
+
+void xdp_transmit::kick()
+{
+    // In copy mode, frames are only sent from within the system call
+    if (zerocopy && !(__atomic_load_n(tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP))
+        return;
+    if (sendto(fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0)
+    {
+        // These indicate that the kernel is busy and the frames will be sent later
+        if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "sendto failed");
+    }
+}
+
+void xdp_transmit::reap()
+{
+    std::uint32_t producer = __atomic_load_n(cq.producer, __ATOMIC_ACQUIRE);
+    std::uint32_t consumer = *cq.consumer;
+    if (producer != consumer)
+    {
+        // The entries are the frame addresses, which are not needed
+        __atomic_store_n(cq.consumer, producer, __ATOMIC_RELEASE);
+        outstanding -= producer - consumer;
+    }
+}
+
+void xdp_transmit::reap_invalid()
+{
+    xdp_statistics xs = {};
+    socklen_t len = sizeof(xs);
+    if (getsockopt(fd, SOL_XDP, XDP_STATISTICS, &xs, &len) < 0)
+        return;
+    std::uint64_t added = xs.tx_invalid_descs - invalid;
+    invalid = xs.tx_invalid_descs;
+    outstanding -= std::min(std::uint64_t(outstanding), added);
+}
+
+void xdp_transmit::send_packets(std::size_t first, std::size_t last,
+                                time_point start)
+{
+    (void) start; // unused
+    if (first == last)
+        return;
+    if (!bound)
+        bind();
+    std::uint32_t n = last - first;
+    reap();
+    if (outstanding + n > ring_size)
+    {
+        auto wait_start = std::chrono::high_resolution_clock::now();
+        stats.stalls++;
+        do
+        {
+            kick();
+            reap();
+            reap_invalid();
+            stats.retries++;
+        } while (outstanding + n > ring_size);
+        stats.blocked += std::chrono::high_resolution_clock::now() - wait_start;
+    }
+    for (std::size_t i = first; i < last; i++)
+    {
+        tx.entries[tx_producer & (ring_size - 1)] = collector->get_desc(i);
+        tx_producer++;
+    }
+    __atomic_store_n(tx.producer, tx_producer, __ATOMIC_RELEASE);
+    outstanding += n;
+    kick();
+}
+
+void xdp_transmit::flush()
+{
+    if (!bound)
+        return;
+    reap();
+    while (outstanding > 0)
+    {
+        kick();
+        reap();
+        reap_invalid();
+    }
+}
+
+constexpr int xdp_transmit::batch_size;
+constexpr std::uint32_t xdp_transmit::ring_size;
+
+#endif // HAVE_DECL_XDP_UMEM_UNALIGNED_CHUNK_FLAG
@@ -0,0 +1,152 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_XDP_TRANSMIT_H
+#define UDPREPLAY_XDP_TRANSMIT_H
+
+#include <config.h>
+
+#if HAVE_DECL_XDP_UMEM_UNALIGNED_CHUNK_FLAG
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <boost/asio.hpp>
+#include <linux/if_xdp.h>
+#include "common.h"
+#include "frame_builder.h"
+
+/* Holds complete Ethernet frames in a single page-aligned memory area,
+ * which is registered as the UMEM of an AF_XDP socket so that the frames
+ * can be transmitted where they are. Frames are packed so that none
+ * crosses a page boundary. The area grows while loading, but once it has
+ * been registered (see fix) it can no longer move, and adding more frames
+ * than fit is an error.
+ */
+class xdp_collector : public boost::noncopyable
+{
+private:
+    struct frame
+    {
+        std::uint64_t addr;       // offset in the area
+        std::uint32_t len;        // frame length, including headers
+        duration timestamp;
+    };
+
+    frame_builder builder;
+    std::shared_ptr<mac_resolver> resolver;
+    std::size_t max_frame;
+    std::size_t page_size;
+    std::uint8_t *area = nullptr;
+    std::size_t capacity = 0;
+    std::size_t used = 0;
+    bool fixed = false;
+    std::vector<frame> frames;
+    std::size_t total_bytes = 0;
+
+    /// Find space for a frame of @a len bytes, returning its offset
+    std::uint64_t allocate(std::size_t len);
+
+public:
+    xdp_collector(const frame_builder &builder, std::shared_ptr<mac_resolver> resolver,
+                  std::size_t max_frame, std::size_t reserve = 0);
+    ~xdp_collector();
+
+    void add_packet(const packet &pkt);
+    // Payloads are always copied into the frames, so nothing needs to be kept
+    void keep_alive(std::shared_ptr<const void> owner) {}
+    std::size_t num_packets() const;
+    std::size_t packet_size(std::size_t idx) const;
+    duration packet_timestamp(std::size_t idx) const;
+    std::size_t bytes() const;
+    void clear();   // remove all packets, but keep the memory
+    /// Create an empty collector with the same parameters
+    std::unique_ptr<xdp_collector> clone_empty() const;
+    /// Copy all the frames from @a other to the end of this collector
+    void append(xdp_collector &&other);
+
+    /// Prevent the area from moving, and return its address and size
+    std::uint8_t *fix(std::size_t &size);
+    xdp_desc get_desc(std::size_t idx) const;
+};
+
+/// Producer and consumer indices of a ring shared with the kernel
+template<typename T>
+struct xdp_ring
+{
+    std::uint32_t *producer = nullptr;
+    std::uint32_t *consumer = nullptr;
+    std::uint32_t *flags = nullptr;
+    T *entries = nullptr;
+    void *map = nullptr;
+    std::size_t map_size = 0;
+};
+
+/* Sends frames through an AF_XDP socket. Only descriptors are written to
+ * the TX ring, so repeated passes reuse the frames without copying. The
+ * socket is bound on the first send, once the frames are loaded.
+ */
+class xdp_transmit : public boost::noncopyable
+{
+public:
+    static constexpr int batch_size = 64;
+    static constexpr std::uint32_t ring_size = 2048;
+
+private:
+    boost::asio::ip::udp::socket socket; // only to allocate a port number
+    unsigned int ifindex;
+    unsigned int queue;
+    bool require_zerocopy;
+    bool zerocopy = false;
+    int fd = -1;
+    bool bound = false;
+    xdp_ring<xdp_desc> tx;
+    xdp_ring<std::uint64_t> cq;
+    std::uint32_t tx_producer = 0;
+    std::uint32_t outstanding = 0;   // frames posted but not completed
+    std::uint64_t invalid = 0;       // descriptors rejected by the kernel, when last checked
+    std::unique_ptr<xdp_collector> collector;
+    transmit_stats stats;
+
+    /// Register the collector memory and bind the socket
+    void bind();
+    /// Ask the kernel to process the TX ring, if it needs to be asked
+    void kick();
+    /// Consume entries from the completion ring
+    void reap();
+    /**
+     * Stop waiting for descriptors that the kernel rejected, which never
+     * reach the completion ring. This costs a system call, so it is only
+     * done while waiting.
+     */
+    void reap_invalid();
+
+public:
+    typedef xdp_collector collector_type;
+
+    xdp_transmit(const options &opts, boost::asio::io_service &io_service);
+    ~xdp_transmit();
+
+    collector_type &get_collector() { return *collector; }
+    void send_packets(std::size_t first, std::size_t last, time_point start);
+    void flush();
+    const transmit_stats &get_stats() const { return stats; }
+};
+
+#endif // HAVE_DECL_XDP_UMEM_UNALIGNED_CHUNK_FLAG
+#endif // UDPREPLAY_XDP_TRANSMIT_H
@@ -0,0 +1,126 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <system_error>
+#include <stdexcept>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#if HAVE_ZEROCOPY
+# include <linux/errqueue.h>
+#endif
+#include "zerocopy.h"
+
+#if HAVE_ZEROCOPY
+
+const int zerocopy_tracker::send_flags = MSG_ZEROCOPY;
+
+zerocopy_tracker::zerocopy_tracker(int fd, transmit_stats &stats)
+    : fd(fd), stats(stats)
+{
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+        throw std::system_error(errno, std::system_category(), "setsockopt(SO_ZEROCOPY) failed");
+}
+
+void zerocopy_tracker::reap()
+{
+    while (true)
+    {
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in))];
+            cmsghdr align;
+        } control;
+        msghdr msg = {};
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "recvmsg(MSG_ERRQUEUE) failed");
+        }
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+            const sock_extended_err *serr = (const sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+            // Notifications cover an inclusive range of send counters
+            std::uint32_t n = serr->ee_data - serr->ee_info + 1;
+            completed += n;
+            stats.zerocopy_sends += n;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                stats.zerocopy_copied += n;
+        }
+    }
+}
+
+void zerocopy_tracker::wait(std::uint64_t max_outstanding)
+{
+    reap();
+    while (outstanding() > max_outstanding)
+    {
+        // The error queue is signalled as POLLERR, which need not be requested
+        pollfd pfd = {};
+        pfd.fd = fd;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            throw std::system_error(errno, std::system_category(), "poll failed");
+        reap();
+    }
+}
+
+void zerocopy_tracker::handle_error(int err)
+{
+    /* ENOBUFS indicates that the pinned pages or notifications would
+     * exceed a limit (RLIMIT_MEMLOCK or optmem_max).
+     */
+    if (err == ENOBUFS && outstanding() > 0)
+        wait(outstanding() / 2);
+    else
+        throw std::system_error(err, std::system_category(), "send failed");
+}
+
+#else // !HAVE_ZEROCOPY
+
+const int zerocopy_tracker::send_flags = 0;
+
+zerocopy_tracker::zerocopy_tracker(int fd, transmit_stats &stats)
+    : fd(fd), stats(stats)
+{
+    throw std::runtime_error("MSG_ZEROCOPY is not supported on this system");
+}
+
+void zerocopy_tracker::reap()
+{
+}
+
+void zerocopy_tracker::wait(std::uint64_t max_outstanding)
+{
+}
+
+void zerocopy_tracker::handle_error(int err)
+{
+    throw std::system_error(err, std::system_category(), "send failed");
+}
+
+#endif // !HAVE_ZEROCOPY
@@ -0,0 +1,64 @@
+/* Copyright 2015-2016, 2018 SKA South Africa
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UDPREPLAY_ZEROCOPY_H
+#define UDPREPLAY_ZEROCOPY_H
+
+#include <config.h>
+#include <cstdint>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include "common.h"
+
+/* Tracks sends made with MSG_ZEROCOPY on a socket. The kernel may still be
+ * reading a payload after the send returns, so the payload must not be
+ * modified or freed until the completion notification for it has been read
+ * from the socket error queue. The completed sends are counted in the
+ * zerocopy_sends and zerocopy_copied fields of a transmit_stats.
+ *
+ * If zero-copy is not supported on this system, the constructor throws.
+ */
+class zerocopy_tracker : public boost::noncopyable
+{
+private:
+    int fd;
+    transmit_stats &stats;
+    std::uint64_t sent = 0;
+    std::uint64_t completed = 0;
+
+public:
+    /// Flags to add to send calls
+    static const int send_flags;
+
+    /// Enables SO_ZEROCOPY on @a fd, and records the completions in @a stats
+    zerocopy_tracker(int fd, transmit_stats &stats);
+
+    /// Record that @a n messages were sent with @ref send_flags
+    void add_sent(std::size_t n) { sent += n; }
+    std::uint64_t outstanding() const { return sent - completed; }
+    /// Read any available completions, without blocking
+    void reap();
+    /// Wait until at most @a max_outstanding sends remain incomplete
+    void wait(std::uint64_t max_outstanding);
+    /**
+     * Handle a send that failed with @a err. If it was due to too many
+     * outstanding sends, wait for some to complete and return; otherwise
+     * throw.
+     */
+    void handle_error(int err);
+};
+
+#endif // UDPREPLAY_ZEROCOPY_H